@@ -0,0 +1,330 @@
+/*
+ * Codec microbenchmarks.
+ *
+ *   bench [-n iterations] [-c cpu]
+ *
+ * Every case runs on a prepared buffer in a loop and reports time per
+ * operation; results are summed into a checksum so the work is not
+ * optimized away. Requests are shaped after what nginx sends with stock
+ * fastcgi_params: a short set where every length fits one byte and a
+ * long one with browser headers and a large cookie, where a few values
+ * take 4-byte lengths. The wide set is the long one with every value over
+ * 127 bytes, all 4-byte lengths. Pin to an idle CPU with -c for numbers
+ * comparable between runs.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define HAVE_BOOST_STRING_REF 1
+#include "tinyfcgi.hpp"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+using boost::string_ref;
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t checksum = 0;
+
+static void report(const char* name, double elapsed, size_t ops, size_t bytes) {
+  std::cout << std::left << std::setw(32) << name << std::right
+    << std::setw(10) << std::fixed << std::setprecision(2) << elapsed * 1e9 / ops << " ns/op"
+    << std::setw(10) << std::setprecision(0) << bytes / elapsed / (1 << 20) << " MB/s"
+    << std::endl;
+}
+
+/*
+ * Chatty STDERR: many small records of 0..31 bytes for several ids
+ */
+static std::string small_records(size_t count) {
+  std::string out;
+  char buf[64 * 1024];
+  for(size_t i = 0; i < count; ) {
+    tinyfcgi::message m((uint16_t)(i % 4 + 1), buf, sizeof(buf));
+    for(; i < count && m.size() + 64 < sizeof(buf); ++i) {
+      m.append(FCGI_STDERR, string_ref("log line #0123456789abcdefghij", i % 32))
+        .end_stream(FCGI_STDERR);
+    }
+    out.append(m.data(), m.size());
+  }
+  return out;
+}
+
+static void bench_iterator(const char* name, const std::string& buf, size_t records, size_t iterations) {
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    tinyfcgi::const_message m(buf.data(), buf.size());
+    for(tinyfcgi::const_message::iterator i = m.begin(); i != m.end(); ++i) {
+      if (!i->valid()) break;
+      checksum += i->size() + i->id();
+    }
+  }
+  report(name, now() - start, records * iterations, buf.size() * iterations);
+}
+
+static size_t records_in(const std::string& buf) {
+  size_t count = 0;
+  tinyfcgi::const_message m(buf.data(), buf.size());
+  for(tinyfcgi::const_message::iterator i = m.begin(); i != m.end() && i->valid(); ++i) ++count;
+  return count;
+}
+
+typedef std::vector<std::pair<std::string, std::string> > params;
+
+static params nginx_params(bool browser) {
+  params p;
+  p.push_back(std::make_pair("QUERY_STRING", "id=42&page=3"));
+  p.push_back(std::make_pair("REQUEST_METHOD", "POST"));
+  p.push_back(std::make_pair("CONTENT_TYPE", "application/x-www-form-urlencoded"));
+  p.push_back(std::make_pair("CONTENT_LENGTH", "1024"));
+  p.push_back(std::make_pair("SCRIPT_NAME", "/app/index.php"));
+  p.push_back(std::make_pair("SCRIPT_FILENAME", "/var/www/app/index.php"));
+  p.push_back(std::make_pair("REQUEST_URI", "/app/index.php?id=42&page=3"));
+  p.push_back(std::make_pair("DOCUMENT_URI", "/app/index.php"));
+  p.push_back(std::make_pair("DOCUMENT_ROOT", "/var/www"));
+  p.push_back(std::make_pair("SERVER_PROTOCOL", "HTTP/1.1"));
+  p.push_back(std::make_pair("REQUEST_SCHEME", "https"));
+  p.push_back(std::make_pair("HTTPS", "on"));
+  p.push_back(std::make_pair("GATEWAY_INTERFACE", "CGI/1.1"));
+  p.push_back(std::make_pair("SERVER_SOFTWARE", "nginx/1.24.0"));
+  p.push_back(std::make_pair("REMOTE_ADDR", "192.0.2.17"));
+  p.push_back(std::make_pair("REMOTE_PORT", "51234"));
+  p.push_back(std::make_pair("SERVER_ADDR", "198.51.100.5"));
+  p.push_back(std::make_pair("SERVER_PORT", "443"));
+  p.push_back(std::make_pair("SERVER_NAME", "www.example.com"));
+  p.push_back(std::make_pair("REDIRECT_STATUS", "200"));
+  p.push_back(std::make_pair("HTTP_HOST", "www.example.com"));
+  p.push_back(std::make_pair("HTTP_CONNECTION", "keep-alive"));
+  p.push_back(std::make_pair("HTTP_ACCEPT", "*/*"));
+  p.push_back(std::make_pair("HTTP_ACCEPT_ENCODING", "gzip, deflate, br"));
+  p.push_back(std::make_pair("HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.9"));
+  p.push_back(std::make_pair("HTTP_CONTENT_TYPE", "application/x-www-form-urlencoded"));
+  p.push_back(std::make_pair("HTTP_CONTENT_LENGTH", "1024"));
+  p.push_back(std::make_pair("HTTP_ORIGIN", "https://www.example.com"));
+  p.push_back(std::make_pair("HTTP_USER_AGENT", "curl/8.5.0"));
+  p.push_back(std::make_pair("HTTP_X_REQUEST_ID", "7f3c9a1e5b2d4c6f"));
+  if (!browser) return p;
+
+  p[p.size() - 2].second = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36";
+  p[22].second = "text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7";
+  p.push_back(std::make_pair("HTTP_REFERER", "https://www.example.com/app/index.php?"
+    "id=41&page=2&utm_source=newsletter&utm_medium=email&utm_campaign=spring_sale_2024"
+    "&utm_content=header_banner&utm_term=discount"));
+  p.push_back(std::make_pair("HTTP_SEC_CH_UA",
+    "\"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\""));
+  p.push_back(std::make_pair("HTTP_SEC_CH_UA_MOBILE", "?0"));
+  p.push_back(std::make_pair("HTTP_SEC_CH_UA_PLATFORM", "\"Linux\""));
+  p.push_back(std::make_pair("HTTP_SEC_FETCH_SITE", "same-origin"));
+  p.push_back(std::make_pair("HTTP_SEC_FETCH_MODE", "navigate"));
+  p.push_back(std::make_pair("HTTP_SEC_FETCH_USER", "?1"));
+  p.push_back(std::make_pair("HTTP_SEC_FETCH_DEST", "document"));
+  p.push_back(std::make_pair("HTTP_UPGRADE_INSECURE_REQUESTS", "1"));
+  p.push_back(std::make_pair("HTTP_CACHE_CONTROL", "max-age=0"));
+  p.push_back(std::make_pair("HTTP_IF_NONE_MATCH", "W/\"5f2a-18c3e4b7d2a\""));
+  p.push_back(std::make_pair("HTTP_X_FORWARDED_FOR", "203.0.113.9, 198.51.100.77"));
+  p.push_back(std::make_pair("HTTP_X_FORWARDED_PROTO", "https"));
+  p.push_back(std::make_pair("HTTP_AUTHORIZATION", "Bearer " + std::string(600, 'J')));
+
+  std::string cookie;
+  for(int i = 0; cookie.size() < 4000; ++i) {
+    if (i) cookie += "; ";
+    cookie += "c" + std::to_string(i) + "=" + std::string(120, 'a' + i % 26);
+  }
+  p.push_back(std::make_pair("HTTP_COOKIE", cookie));
+  return p;
+}
+
+/*
+ * Same params with every value padded to take a 4-byte length
+ */
+static params wide_values(params p) {
+  for(size_t i = 0; i < p.size(); ++i) {
+    if (p[i].second.size() < 128) p[i].second.resize(128, ' ');
+  }
+  return p;
+}
+
+static size_t build_request(char* buf, size_t capacity, const params& p, const string_ref& body) {
+  tinyfcgi::message m(1, buf, capacity);
+  m.begin_request(FCGI_RESPONDER, FCGI_KEEP_CONN);
+  for(size_t i = 0; i < p.size(); ++i) {
+    m.add_param(p[i].first, p[i].second);
+  }
+  m.end_stream(FCGI_PARAMS)
+    .append(FCGI_STDIN, body)
+    .end_stream(FCGI_STDIN);
+  return m.size();
+}
+
+/*
+ * Content of the first PARAMS record, the whole block for these sets
+ */
+static string_ref params_block(const std::string& req) {
+  tinyfcgi::const_message m(req.data(), req.size());
+  for(tinyfcgi::const_message::iterator i = m.begin(); i != m.end(); ++i) {
+    if (i->type == FCGI_PARAMS) return i->str();
+  }
+  return string_ref();
+}
+
+static void bench_build_request(const char* name, const params& p, size_t iterations) {
+  static char buf[64 * 1024];
+  std::string body(1024, 'b');
+  size_t size = 0;
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    size = build_request(buf, sizeof(buf), p, body);
+    checksum += size + (unsigned char)buf[size - 1];
+  }
+  report(name, now() - start, iterations, size * iterations);
+}
+
+/*
+ * Response as a handler writes it: headers, body in small pieces, end
+ */
+static void bench_build_response(size_t iterations) {
+  static char buf[64 * 1024];
+  const size_t pieces = 64;
+  std::string piece(200, 'r');
+  size_t size = 0;
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    tinyfcgi::message m(1, buf, sizeof(buf));
+    m.append(FCGI_STDOUT, "Status: 200\r\nContent-Type: text/html\r\n\r\n");
+    for(size_t i = 0; i < pieces; ++i) {
+      m.append(FCGI_STDOUT, piece);
+    }
+    m.end_stream(FCGI_STDOUT)
+      .end_request(0, FCGI_REQUEST_COMPLETE);
+    size = m.size();
+    checksum += size + (unsigned char)buf[size - 1];
+  }
+  report("message append (64 pieces)", now() - start, iterations, size * iterations);
+}
+
+static void bench_params(const char* name, const string_ref& block, size_t iterations) {
+  size_t count = 0;
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    tinyfcgi::const_params ps(block);
+    count = 0;
+    for(tinyfcgi::const_params::iterator i = ps.begin(); i != ps.end(); ++i, ++count) {
+      string_ref n, v;
+      i->read(n, v);
+      checksum += n.size() + v.size() + (unsigned char)v[0];
+    }
+  }
+  report(name, now() - start, count * iterations, block.size() * iterations);
+}
+
+static void bench_index(const char* name, const string_ref& block, size_t iterations) {
+  tinyfcgi::params_index index;
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    index.build(tinyfcgi::const_params(block));
+    checksum += index.size() + index.get(tinyfcgi::params_index::REQUEST_URI).size();
+  }
+  report(name, now() - start, iterations, block.size() * iterations);
+}
+
+/*
+ * Merging a run of STDOUT records into one; the buffer is restored from
+ * a copy every round, the copy is timed too
+ */
+static void bench_merge(size_t iterations) {
+  static char buf[64 * 1024];
+  const size_t records = 64;
+  std::string piece(100, 'm');
+  tinyfcgi::message m(1, buf, sizeof(buf));
+  for(size_t i = 0; i < records; ++i) {
+    m.append(FCGI_STDOUT, piece);
+  }
+  std::string orig(m.data(), m.size());
+
+  double start = now();
+  for(size_t k = 0; k < iterations; ++k) {
+    memcpy(buf, orig.data(), orig.size());
+    tinyfcgi::header* h = (tinyfcgi::header*)buf;
+    for(size_t i = 1; i < records; ++i) {
+      h->merge_next();
+    }
+    checksum += h->size();
+  }
+  report("header::merge_next", now() - start, (records - 1) * iterations, orig.size() * iterations);
+}
+
+int main(int argc, char** argv) {
+  size_t iterations = 1000;
+
+  int c;
+  while((c = getopt(argc, argv, "n:c:")) != -1) {
+    switch(c) {
+    case 'n': iterations = strtoul(optarg, 0, 10); break;
+    case 'c': {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(atoi(optarg), &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return 1;
+      }
+      break;
+    }
+    default:
+      std::cerr << "usage: " << argv[0] << " [-n iterations] [-c cpu]" << std::endl;
+      return 1;
+    }
+  }
+
+  const size_t records = 10000;
+  std::string small = small_records(records);
+  // each append and end_stream makes one record, empty appends make none
+  size_t count = records_in(small);
+
+  std::cout << count << " records, " << small.size() << " bytes" << std::endl;
+  bench_iterator("const_message iterator", small, count, iterations);
+
+  params short_set = nginx_params(false);
+  params long_set = nginx_params(true);
+  params wide_set = wide_values(long_set);
+  std::string body(1024, 'b');
+  static char buf[64 * 1024];
+  std::string short_req(buf, build_request(buf, sizeof(buf), short_set, body));
+  std::string long_req(buf, build_request(buf, sizeof(buf), long_set, body));
+  std::string wide_req(buf, build_request(buf, sizeof(buf), wide_set, body));
+  string_ref short_block = params_block(short_req);
+  string_ref long_block = params_block(long_req);
+  string_ref wide_block = params_block(wide_req);
+
+  std::cout << std::endl << short_set.size() << " short params, " << short_block.size() << " bytes; "
+    << long_set.size() << " long params, " << long_block.size() << " bytes; "
+    << "wide " << wide_block.size() << " bytes" << std::endl;
+  bench_build_request("message request (short)", short_set, iterations * 10);
+  bench_build_request("message request (long)", long_set, iterations * 10);
+  bench_build_request("message request (wide)", wide_set, iterations * 10);
+  bench_build_response(iterations * 10);
+  bench_iterator("const_message (long request)", long_req, records_in(long_req), iterations * 100);
+  bench_params("const_params (short)", short_block, iterations * 10);
+  bench_params("const_params (long)", long_block, iterations * 10);
+  bench_params("const_params (wide)", wide_block, iterations * 10);
+  bench_index("params_index build (short)", short_block, iterations * 10);
+  bench_index("params_index build (long)", long_block, iterations * 10);
+  bench_index("params_index build (wide)", wide_block, iterations * 10);
+  bench_merge(iterations * 10);
+
+  std::cout << "checksum " << checksum << std::endl;
+  return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Throughput of tinyfcgi::workers against number of worker threads.
+ *
+ *   bench_workers [-u path | -t port] [-T max_threads] [-c conns_per_thread] [-d seconds] [-r]
+ *
+ * For every thread count 1, 2, 4 .. max_threads the engine is started
+ * in-process, client threads (one blocking keep-alive connection each)
+ * send minimal requests for given time and completed requests are counted.
+ * -r runs workers on io_uring backend.
+ * Clients share the CPUs with workers, so run it on a box with cores to spare.
+ */
+#include <iostream>
+#include <iomanip>
+
+#define HAVE_BOOST_STRING_REF 1
+#include "tinyfcgi_server.hpp"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <time.h>
+
+using boost::string_ref;
+
+class ok_handler : public tinyfcgi::handler {
+public:
+  void on_request(tinyfcgi::request& r) {
+    r.write("Status: 200\r\nContent-Length: 2\r\n\r\nOk")
+      .end_request(0);
+  }
+};
+
+class response_reader {
+public:
+  response_reader() : complete(false) { }
+
+  bool on_header(const tinyfcgi::header& /* h */) { return true; }
+  bool on_content(const tinyfcgi::header& /* h */, const string_ref& /* s */) { return true; }
+  bool on_record(const tinyfcgi::header& h) {
+    if (h.type == FCGI_END_REQUEST) complete = true;
+    return true;
+  }
+
+  bool complete;
+};
+
+struct options {
+  const char* path;
+  unsigned short port;
+  size_t max_threads;
+  size_t conns;
+  double seconds;
+  bool uring;
+};
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const options& o) {
+  int fd;
+  if (o.path) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, o.path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(o.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+      close(fd);
+      return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static void client(const options& o, const std::atomic<bool>& running,
+  std::atomic<uint64_t>& done) {
+  int fd = connect_to(o);
+  if (fd == -1) {
+    std::cerr << "connect() failed: " << errno << std::endl;
+    return;
+  }
+
+  char req[1024];
+  tinyfcgi::message m(1, req, sizeof(req));
+  m.begin_request(FCGI_RESPONDER, FCGI_KEEP_CONN)
+    .add_param("REQUEST_METHOD", "GET")
+    .add_param("SCRIPT_NAME", "/bench")
+    .add_param("QUERY_STRING", "")
+    .end_stream(FCGI_PARAMS)
+    .end_stream(FCGI_STDIN);
+
+  char buf[4096];
+  uint64_t n = 0;
+  while(running.load(std::memory_order_relaxed)) {
+    if (send(fd, m.data(), m.size(), MSG_NOSIGNAL) != (ssize_t)m.size()) break;
+
+    tinyfcgi::parser p;
+    response_reader r;
+    size_t pos = 0;
+    while(!r.complete) {
+      ssize_t res = read(fd, buf + pos, sizeof(buf) - pos);
+      if (res <= 0) break;
+      pos += res;
+      if (!p.parse(buf, pos, r)) break;
+
+      size_t used = p.parsed();
+      memmove(buf, buf + used, pos - used);
+      pos -= used;
+      p.consume(used);
+    }
+    if (!r.complete) break;
+    ++n;
+  }
+  done += n;
+  close(fd);
+}
+
+static double run(const options& o, size_t threads) {
+  ok_handler h;
+  tinyfcgi::workers w(h, threads);
+  if (o.uring && w.use_uring() == -1) {
+    std::cerr << "io_uring is not supported, using epoll" << std::endl;
+  }
+
+  if (o.path) {
+    unlink(o.path);
+    if (w.listen_unix(o.path, 1024) == -1) {
+      std::cerr << "listen_unix() failed: " << errno << std::endl;
+      return 0;
+    }
+  } else if (w.listen_tcp("127.0.0.1", o.port, 1024) == -1) {
+    std::cerr << "listen_tcp() failed: " << errno << std::endl;
+    return 0;
+  }
+
+  std::thread engine(&tinyfcgi::workers::run, &w);
+
+  std::atomic<bool> running(true);
+  std::atomic<uint64_t> done(0);
+  std::vector<std::thread> clients;
+  for(size_t i = 0; i < threads * o.conns; ++i) {
+    clients.push_back(std::thread(client, std::cref(o), std::cref(running), std::ref(done)));
+  }
+
+  double start = now();
+  usleep((useconds_t)(o.seconds * 1e6));
+  running = false;
+  for(size_t i = 0; i < clients.size(); ++i) {
+    clients[i].join();
+  }
+  double elapsed = now() - start;
+
+  w.stop();
+  engine.join();
+  if (o.path) unlink(o.path);
+
+  return done / elapsed;
+}
+
+int main(int argc, char** argv) {
+  options o;
+  o.path = "bench.sock";
+  o.port = 0;
+  o.max_threads = std::thread::hardware_concurrency();
+  o.conns = 4;
+  o.seconds = 2;
+  o.uring = false;
+
+  int c;
+  while((c = getopt(argc, argv, "u:t:T:c:d:r")) != -1) {
+    switch(c) {
+    case 'u': o.path = optarg; break;
+    case 't': o.path = 0; o.port = atoi(optarg); break;
+    case 'T': o.max_threads = strtoul(optarg, 0, 10); break;
+    case 'c': o.conns = strtoul(optarg, 0, 10); break;
+    case 'd': o.seconds = atof(optarg); break;
+    case 'r': o.uring = true; break;
+    default:
+      std::cerr << "usage: " << argv[0]
+        << " [-u path | -t port] [-T max_threads] [-c conns_per_thread] [-d seconds] [-r]" << std::endl;
+      return 1;
+    }
+  }
+  if (o.max_threads == 0) o.max_threads = 1;
+
+  std::cout << "threads        req/s   speedup" << std::endl;
+  double base = 0;
+  for(size_t t = 1; ; t *= 2) {
+    if (t > o.max_threads) t = o.max_threads;
+
+    double rps = run(o, t);
+    if (t == 1) base = rps;
+    std::cout << std::setw(7) << t
+      << std::setw(13) << std::fixed << std::setprecision(0) << rps
+      << std::setw(10) << std::setprecision(2) << (base > 0 ? rps / base : 0)
+      << std::endl;
+
+    if (t == o.max_threads) break;
+  }
+  return 0;
+}
@@ -6,109 +6,133 @@
 #define ERROR(x) std::cerr << x << std::endl
 
 #define HAVE_BOOST_STRING_REF 1
-#include "tinyfcgi.hpp"
+#include "tinyfcgi_client.hpp"
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <errno.h>
-
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 using boost::string_ref;
 
-int main(int argc, char** argv) {
-  const char* path = "sock";
- 
-  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sock == -1) {
-    std::cerr << "socket() failed: " << errno << std::endl;
-    return 1;
+/*
+ * Sends the next request when one is over, until count are done
+ */
+class repeat_call : public tinyfcgi::call {
+public:
+  repeat_call(tinyfcgi::client& c, int upstream, const string_ref* params, size_t count,
+    const string_ref& body, size_t& left) :
+    tinyfcgi::call(params, count, body), client_(c), upstream_(upstream), left_(left),
+    bytes_(0), errors_(0) { }
+
+  void on_stdout(const string_ref& chunk) {
+    bytes_ += chunk.size();
   }
-
-  if (argc > 1) {
-    path = argv[1];
+  void on_end(unsigned int /* app_status */, unsigned char proto_status) {
+    if (proto_status != FCGI_REQUEST_COMPLETE) ++errors_;
+    next();
+  }
+  void on_error(int err) {
+    WARN("request failed: " << strerror(err));
+    ++errors_;
+    next();
   }
 
-  sockaddr_un connect_addr;
-  memset(&connect_addr, 0, sizeof(connect_addr));
-
-  connect_addr.sun_family = AF_UNIX;
-  strncpy(connect_addr.sun_path, path, sizeof(connect_addr.sun_path) - 1);
+  size_t bytes() const { return bytes_; }
+  size_t errors() const { return errors_; }
 
-  if (connect(sock, (struct sockaddr *) &connect_addr,
-         sizeof(connect_addr)) == -1)
-  {
-    std::cerr << "connect() failed: " << errno << std::endl;
-    return 2;
+private:
+  void next() {
+    if (left_) {
+      --left_;
+      client_.send(upstream_, *this);
+    }
   }
 
-  {
-    // allocate buffer for message
-    char buf[64 * 1024];
-
-    // construct tinyfcgi::message on buffer
-    tinyfcgi::message m(1, buf, sizeof(buf));
-
-    m.begin_request(FCGI_RESPONDER, FCGI_KEEP_CONN)       // initialize request
-      .add_param("TANYA", "1")                 // add parameter
-      .add_param("PETYA", "2")                 //   .. one more
-      .append(FCGI_STDIN, "Tanya + Petya");    // append STDIN stream
-
-    m.append(FCGI_STDIN, " = ?")               // append more
-      .end_stream(FCGI_STDIN);                 // finalize request
-
-    DEBUG("m.size() = " << m.size());
-    size_t s = m.size();
-    size_t pos = 0;
-    while(pos < s) {
-      ssize_t res = send(sock, buf + pos, s - pos, 0);                 // send out
-      DEBUG("send(): " << res);
-      if (res == -1) {
-        std::cerr << "send() failed: " << errno << std::endl;
-        return 3;
-      }
-      pos += res;
-    }
+private:
+  tinyfcgi::client& client_;
+  int upstream_;
+  size_t& left_;
+  size_t bytes_;
+  size_t errors_;
+};
+
+static double now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  const char* path = "sock";
+  size_t requests = 1;
+  size_t max_conns = 4;
+  size_t max_reqs = 1;
+
+  if (argc > 1) path = argv[1];
+  if (argc > 2) requests = strtoul(argv[2], 0, 10);
+  if (argc > 3) max_conns = strtoul(argv[3], 0, 10);
+  if (argc > 4) max_reqs = strtoul(argv[4], 0, 10);
+
+  tinyfcgi::client c;
+
+  // host:port is TCP, anything else is UNIX socket path
+  int up;
+  const char* colon = strrchr(path, ':');
+  if (colon) {
+    std::string host(path, colon - path);
+    up = c.upstream_tcp(host.c_str(), atoi(colon + 1), max_conns, max_reqs);
+  } else {
+    up = c.upstream_unix(path, max_conns, max_reqs);
+  }
+  if (up == -1) {
+    std::cerr << "bad upstream " << path << ": " << errno << std::endl;
+    return 1;
   }
 
-  {
-    // allocate buffer for message
-    char buf[64 * 1024];
-    size_t pos = 0;
-
-    bool need_more(true);
-    do {
-      ssize_t r = read(sock, buf + pos, sizeof(buf) - pos);
-      DEBUG("read(): " << r);
-      if (r == -1) {
-        std::cerr << "read() failed: " << errno << std::endl;
-        return 4;
-      }
-      if (r == 0) {
-        std::cerr << "read() connection closed by peer: " << errno << std::endl;
-        return 5;
-      }
-      pos += r;
-
-      tinyfcgi::const_message m( string_ref(buf, pos) );
-      for(tinyfcgi::const_message::iterator i = m.begin(); i != m.end(); ++i) {
-        DEBUG("header: " << (unsigned int)i->type << "/" << i->size());
-        if (!i->valid()) {
-          std::cerr << "header is invalid" << std::endl;
-          return 5;
-        }
-        if (i->type == FCGI_END_REQUEST) {
-          need_more = false;
-        }
-      }
-    } while(need_more);
-
-    tinyfcgi::const_message m( string_ref(buf, pos) );
-    for(tinyfcgi::const_message::iterator i = m.begin(); i != m.end(); ++i) {
-      std::cout << "type: " << (unsigned int)i->type << std::endl;
-      std::cout << "size: " << i->size() << std::endl;
+  string_ref params[] = {
+    "TANYA", "1",
+    "PETYA", "2"
+  };
+  string_ref body("Tanya + Petya = ?");
+
+  if (requests == 1) {
+    // one request, its response in memory
+    tinyfcgi::buffered_call b(params, 2, body);
+    c.send(up, b);
+    while(!b.done()) c.poll(-1);
+
+    if (b.error()) {
+      std::cerr << "request failed: " << strerror(b.error()) << std::endl;
+      return 2;
     }
+    DEBUG("app_status: " << b.app_status() << ", protocol_status: " << (unsigned int)b.proto_status());
+    DEBUG("stdout: " << b.output());
+    if (!b.errors().empty()) DEBUG("stderr: " << b.errors());
+    return 0;
   }
 
-  return 0;
+  // as many requests in flight as connections can carry
+  size_t slots = max_conns * max_reqs;
+  if (slots > requests) slots = requests;
+  size_t left = requests - slots;
+
+  std::vector<repeat_call*> calls;
+  double start = now();
+  for(size_t i = 0; i < slots; ++i) {
+    calls.push_back(new repeat_call(c, up, params, 2, body, left));
+    c.send(up, *calls.back());
+  }
+  while(c.pending()) c.poll(-1);
+  double elapsed = now() - start;
+
+  size_t bytes = 0, errors = 0;
+  for(size_t i = 0; i < calls.size(); ++i) {
+    bytes += calls[i]->bytes();
+    errors += calls[i]->errors();
+    delete calls[i];
+  }
+  INFO(requests << " requests in " << elapsed << " s, " << (size_t)(requests / elapsed)
+    << " req/s, " << bytes << " bytes of stdout, " << errors << " errors");
+  return errors ? 3 : 0;
 }
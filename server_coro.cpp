@@ -0,0 +1,96 @@
+#include <iostream>
+// per-request logging writes synchronously from the loop, -DVERBOSE turns it on
+#ifdef VERBOSE
+#define TRACE(x) std::cout << x << std::endl
+#define DEBUG(x) std::cout << x << std::endl
+#else
+#define TRACE(x)
+#define DEBUG(x)
+#endif
+#define INFO(x)  std::cout << x << std::endl
+#define WARN(x)  std::cerr << x << std::endl
+#define ERROR(x) std::cerr << x << std::endl
+
+#define HAVE_BOOST_STRING_REF 1
+#include "tinyfcgi_coro.hpp"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+using boost::string_ref;
+
+/*
+ * Echoes request body back as many times as QUERY_STRING says, chunk
+ * by chunk as it arrives, under flow control
+ */
+class echo_handler : public tinyfcgi::coroutine_handler {
+public:
+  tinyfcgi::task<void> handle(tinyfcgi::request& r) {
+    string_ref query = r.param(tinyfcgi::params_index::QUERY_STRING);
+    size_t count = query.empty() ? 1 : strtoul(std::string(query).c_str(), 0, 10);
+
+    DEBUG("request #" << r.id() << " " << r.content_length() << " bytes x " << count);
+
+    co_await r.write_stdout("Status: 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n");
+    size_t sent = 0;
+    std::string held;
+    for(;;) {
+      string_ref chunk = co_await r.read_stdin();
+      if (chunk.empty()) break;
+      if (count > 1) {
+        // chunk is gone after a write suspends, repeats need a copy
+        held.assign(chunk.data(), chunk.size());
+        chunk = held;
+      }
+      for(size_t i = 0; i < count; ++i) {
+        sent += co_await write_chunk(r, chunk);
+        if (r.aborted()) {
+          DEBUG("request #" << r.id() << " aborted after " << sent << " bytes");
+          co_return;
+        }
+      }
+    }
+    r.end_request(0);
+  }
+
+private:
+  tinyfcgi::task<size_t> write_chunk(tinyfcgi::request& r, string_ref chunk) {
+    bool ok = co_await r.write_stdout(chunk);
+    co_return ok ? chunk.size() : 0;
+  }
+};
+
+int main(int argc, char** argv) {
+  const char* path = "sock";
+  int backlog = 1024;
+  size_t threads = 1;
+
+  INFO("__cplusplus = " << __cplusplus);
+
+  if (argc > 1) {
+    path = argv[1];
+  }
+  if (argc > 2) {
+    threads = strtoul(argv[2], 0, 10);
+  }
+
+  echo_handler h;
+  tinyfcgi::workers w(h, threads);
+  w.stats_path("/tinyfcgi-stats");                                    // metrics of all workers
+
+  if (argc > 3 && strcmp(argv[3], "uring") == 0 && w.use_uring() == -1) {
+    WARN("io_uring is not supported, using epoll");
+  }
+
+  if (w.listen_unix(path, backlog) == -1) {
+    std::cerr << "listen_unix() failed: " << errno << std::endl;
+    return 2;
+  }
+
+  if (w.run() == -1) {
+    std::cerr << "run() failed: " << errno << std::endl;
+    return 4;
+  }
+  return 0;
+}
@@ -53,6 +53,11 @@ Server:
 
   ssize_t res = recv(sock, buf, sizeof(buf), 0);                      // let's assume we get all request
   {
+    tinyfcgi::buffer_pool pool(4 * 1024);
+    tinyfcgi::arena scratch(pool);                                    // only pairs cut by record boundary go here
+    tinyfcgi::params_reader pr(scratch);
+    tinyfcgi::params_index index;                                     // or any class with on_param(name, value)
+
     tinyfcgi::const_message m(buf, res);
     for(tinyfcgi::const_message::iterator i = m.begin();              // enum all headers
       i != m.end(); ++i) {
@@ -67,13 +72,10 @@ Server:
         std::cout << ": " << h.str();
       }
       if (h.type == FCGI_PARAMS) {
-        tinyfcgi::const_params params(h.str());
-        for(tinyfcgi::const_params::iterator i = params.begin();      // enum all params
-          i != params.end(); ++i) {
-          const tinyfcgi::param& p = *i;
-          string_ref name, value;
-          p.read(name, value);
-          std::cout << "  " << name << ": " << value << std::endl;
+        pr.feed(h.str(), index);                                      // pairs may span records
+        if (h.size() == 0) {                                          // stream is terminated
+          assert(pr.complete());
+          std::cout << "  REQUEST_URI: " << index.get(tinyfcgi::params_index::REQUEST_URI);
         }
       }
       std::cout << std::endl;
@@ -93,6 +95,88 @@ Server:
   }
 }
 
+Zero-copy response:
+
+{
+  char hdrs[256];                                                     // headers and padding go here
+  struct iovec iov[64];
+  tinyfcgi::iov_message m(id, hdrs, sizeof(hdrs), iov, 64);
+
+  m.append(FCGI_STDOUT, "Content-Type: text/html\r\n\r\n")
+    .append(FCGI_STDOUT, string_ref(page, page_size))                 // payload is referenced, not copied
+    .end_stream(FCGI_STDOUT)
+    .end_request(0, FCGI_REQUEST_COMPLETE);
+
+  while(m.size()) {
+    ssize_t res = writev(sock, m.iov(), m.iovcnt());                  // keep iovcnt() under IOV_MAX
+    m.consume(res);                                                   // handles partial writes
+  }
+}
+
+Streaming response:
+
+{
+  tinyfcgi::buffer_pool pool(16 * 1024);                              // one per thread, buffers are reused
+  tinyfcgi::chain_message m(id, pool);
+
+  while(more_rows()) {
+    m.append(FCGI_STDOUT, next_row());                                // grows chain buffer by buffer
+
+    struct iovec v[16];
+    size_t n = m.iov(v, 16);                                          // complete buffers are ready ..
+    if (n) m.consume(writev(sock, v, n));                             // .. and go back to pool once written
+  }
+  m.end_stream(FCGI_STDOUT)
+    .end_request(0, FCGI_REQUEST_COMPLETE);                           // everything is ready now
+}
+
+Management:
+
+{
+  tinyfcgi::values q;
+  q.ask(tinyfcgi::values::max_conns).ask(tinyfcgi::values::max_reqs);  // names only
+  tinyfcgi::message m(FCGI_NULL_REQUEST_ID, buf, sizeof(buf));
+  m.get_values(q);                                                    // FCGI_GET_VALUES record
+  send(sock, m.data(), m.size(), 0);
+
+  // ... h is a record with h.id() == FCGI_NULL_REQUEST_ID
+  tinyfcgi::values a;
+  if (h.type == FCGI_GET_VALUES_RESULT && a.parse(h.str())) {
+    size_t reqs = a.get(tinyfcgi::values::max_reqs);                  // 0 when not answered
+  }
+  if (h.type == FCGI_UNKNOWN_TYPE) {
+    unsigned char t = h.unknown_type()->type;                         // record application did not know
+  }
+}
+
+Parser:
+
+struct reader {                                                       // any class with these three methods
+  bool on_header(const tinyfcgi::header& h) { return true; }          // header arrived and is valid
+  bool on_content(const tinyfcgi::header& h, const string_ref& s) {   // next piece of content, reported once
+    return true;
+  }
+  bool on_record(const tinyfcgi::header& h) { return true; }          // whole record is in buffer
+};
+
+{
+  char buf[64 * 1024];
+  size_t pos = 0;
+  tinyfcgi::parser p;
+  reader r;
+
+  while(true) {
+    ssize_t res = recv(sock, buf + pos, sizeof(buf) - pos, 0);
+    pos += res;
+    if (!p.parse(buf, pos, r)) break;                                 // continues from first incomplete record
+
+    size_t done = p.parsed();                                         // complete records may be dropped
+    memmove(buf, buf + done, pos - done);
+    pos -= done;
+    p.consume(done);
+  }
+}
+
  */
 
 // vim:ts=2:sts=2:sw=2:et
@@ -102,7 +186,9 @@ Server:
 #include "fastcgi.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #if HAVE_BOOST_STRING_REF
 // this makes our life easier..
@@ -162,6 +248,7 @@ public:
 
   const begin_request_body* begin_request() const;
   const end_request_body* end_request() const;
+  const FCGI_UnknownTypeBody* unknown_type() const;
 };
 
 
@@ -192,6 +279,10 @@ private:
   unsigned char* data() { return (unsigned char*)this; }
 
   unsigned char dummy_[2];
+
+  friend class message;
+  friend class chain_message;
+  friend class params_reader;
 };
 
 
@@ -229,6 +320,126 @@ private:
 };
 
 
+/*
+ * Variables of FCGI_GET_VALUES and FCGI_GET_VALUES_RESULT management
+ * records, the ones fastcgi.h names. Query carries names only, answer
+ * carries names and decimal values; unknown names are skipped.
+ */
+class values {
+public:
+  enum name {
+    max_conns,
+    max_reqs,
+    mpxs_conns,
+    count
+  };
+
+  values();
+  void clear();
+
+  values& ask(name n);
+  values& set(name n, size_t v);
+  bool has(name n) const;
+  size_t get(name n) const;
+
+  bool parse(const string_ref& content);
+  size_t size(bool with_values) const;
+  char* write(char* buf, bool with_values) const;
+
+  static string_ref str(name n);
+
+private:
+  static size_t format(char* buf, size_t v);
+
+private:
+  unsigned int has_;                // bit per name
+  size_t values_[count];
+};
+
+
+/*
+ * Name-value pairs of decoded FCGI_PARAMS block in open addressing hash
+ * table. Well-known CGI variables are also found through a perfect hash
+ * at build time and then are fetched by enum in O(1). Table is inline,
+ * nothing is allocated; names and values point into params block.
+ */
+class params_index {
+public:
+  enum known {
+    QUERY_STRING,
+    REQUEST_METHOD,
+    CONTENT_TYPE,
+    CONTENT_LENGTH,
+    SCRIPT_NAME,
+    SCRIPT_FILENAME,
+    REQUEST_URI,
+    DOCUMENT_URI,
+    DOCUMENT_ROOT,
+    SERVER_PROTOCOL,
+    REQUEST_SCHEME,
+    HTTPS,
+    GATEWAY_INTERFACE,
+    SERVER_SOFTWARE,
+    REMOTE_ADDR,
+    REMOTE_PORT,
+    REMOTE_USER,
+    SERVER_ADDR,
+    SERVER_PORT,
+    SERVER_NAME,
+    REDIRECT_STATUS,
+    PATH_INFO,
+    PATH_TRANSLATED,
+    AUTH_TYPE,
+    HTTP_HOST,
+    HTTP_COOKIE,
+    HTTP_USER_AGENT,
+    HTTP_ACCEPT,
+    HTTP_ACCEPT_ENCODING,
+    HTTP_ACCEPT_LANGUAGE,
+    HTTP_REFERER,
+    HTTP_AUTHORIZATION,
+    known_count
+  };
+
+  enum {
+    capacity = 128,
+    max_size = capacity * 3 / 4
+  };
+
+  params_index();
+  void clear();
+
+  bool build(const const_params& p);
+  bool add(const string_ref& name, const string_ref& value);
+  bool on_param(const string_ref& name, const string_ref& value);
+
+  bool has(known k) const;
+  string_ref get(known k) const;
+  bool find(const string_ref& name, string_ref& value) const;
+
+  size_t size() const;
+  bool good() const;
+
+  static string_ref name(known k);
+  static int classify(const string_ref& name);
+
+private:
+  struct entry {
+    string_ref name;
+    string_ref value;
+  };
+
+  static uint32_t hash(const string_ref& s);
+
+private:
+  uint32_t hashes_[capacity];
+  entry entries_[capacity];
+  unsigned char known_[known_count];
+  size_t size_;
+  bool good_;
+};
+
+
 class const_message {
 public:
   class iterator {
@@ -264,6 +475,27 @@ private:
 };
 
 
+class parser {
+public:
+  parser();
+  void reset();
+
+  template <typename Handler>
+  bool parse(const char* buf, size_t size, Handler& h);
+
+  size_t parsed() const;
+  void consume(size_t n);
+
+  bool good() const;
+  operator bool() const;
+
+private:
+  size_t pos_;
+  size_t seen_;
+  bool good_;
+};
+
+
 class message {
 public:
   message(uint16_t id, char* buf, size_t capacity);
@@ -280,6 +512,10 @@ public:
 
   message& add_param(const string_ref& name, const string_ref& value);
 
+  message& get_values(const values& v);
+  message& get_values_result(const values& v);
+  message& unknown_type(unsigned char type);
+
   const char* data() const;
   size_t size() const;
   const string_ref str() const;
@@ -289,6 +525,7 @@ public:
 
 private:
   header* add_header(unsigned char type, bool force = false, size_t size = 0);
+  header* add_management(unsigned char type, size_t size);
   char* terminator() const;
   void overflow();
 
@@ -302,6 +539,255 @@ private:
 };
 
 
+/*
+ * Builds records as iovec array: headers, padding and END_REQUEST body go
+ * to small side buffer, payload is referenced in place and has to stay
+ * valid until written out. Payload longer than FCGI_MAX_LENGTH is split.
+ */
+class iov_message {
+public:
+  iov_message(uint16_t id, char* buf, size_t capacity, struct iovec* iov, size_t iovcnt);
+  void clear();
+
+  iov_message& id(uint16_t id);
+
+  iov_message& append(unsigned char type, const string_ref& str);
+  iov_message& end_stream(unsigned char type);
+  iov_message& end_request(unsigned int app_status, unsigned char proto_status);
+
+  const struct iovec* iov() const;
+  size_t iovcnt() const;
+  size_t size() const;
+  void consume(size_t n);
+
+  bool good() const;
+  operator bool() const;
+
+private:
+  header* add_header(unsigned char type, size_t size);
+  char* side(size_t n);
+  bool add_iov(const char* p, size_t n);
+
+private:
+  uint16_t id_;
+  char* buf_;
+  size_t capacity_;
+  size_t used_;
+  struct iovec* iov_;
+  size_t iov_capacity_;
+  size_t first_;
+  size_t last_;
+  size_t size_;
+  bool good_;
+};
+
+
+/*
+ * Fixed size buffers recycled through a free list. Not thread safe,
+ * use one pool per thread.
+ */
+class buffer_pool {
+public:
+  buffer_pool(size_t buffer_size = 16 * 1024, size_t max_free = 1024);
+  ~buffer_pool();
+
+  char* alloc();
+  void free(char* b);
+  void free_chain(char* head, char* tail, size_t count);
+
+  char* alloc_large(size_t size);
+  void free_large(char* b, size_t size);
+
+  size_t buffer_size() const;
+
+  size_t in_use() const;
+  size_t peak() const;
+  size_t cached() const;
+  size_t large_in_use() const;
+  size_t large_peak() const;
+
+private:
+  buffer_pool(const buffer_pool&);
+  buffer_pool& operator=(const buffer_pool&);
+
+private:
+  struct node {
+    node* next;
+  };
+
+  size_t buffer_size_;
+  size_t max_free_;
+  size_t free_count_;
+  node* free_;
+
+  size_t in_use_;
+  size_t peak_;
+  size_t large_in_use_;
+  size_t large_peak_;
+};
+
+
+/*
+ * Bump allocator over buffers of buffer_pool. Allocations too big for a
+ * buffer get their own memory. Everything is released at once with clear(),
+ * buffers go back to pool as one list.
+ */
+class arena {
+public:
+  arena(buffer_pool& pool);
+  ~arena();
+
+  void* alloc(size_t n);
+  bool extend(void* p, size_t size, size_t n);
+  string_ref copy(const string_ref& s);
+  void clear();
+
+  size_t size() const;
+
+private:
+  arena(const arena&);
+  arena& operator=(const arena&);
+
+  struct chunk {
+    chunk* next;
+  };
+
+  struct large {
+    large* next;
+    size_t size;
+  };
+
+private:
+  buffer_pool& pool_;
+  chunk* chunks_;
+  chunk* last_;
+  size_t count_;
+  char* pos_;
+  char* end_;
+  large* large_;
+  size_t size_;
+};
+
+
+/*
+ * Growing byte string living in arena
+ */
+class arena_string {
+public:
+  arena_string();
+
+  bool append(arena& a, const string_ref& s);
+  void rewind();
+  void clear();
+
+  string_ref str() const;
+  size_t size() const;
+
+private:
+  char* data_;
+  size_t size_;
+  size_t capacity_;
+};
+
+
+/*
+ * Decodes name-value pairs from FCGI_PARAMS contents record by record.
+ * Pairs lying inside one record are reported in place; a pair cut by
+ * record boundary is gathered in scratch arena and reported from there
+ * once its last byte arrives. Handler is called as
+ *
+ *   h.on_param(name, value)   - returning false stops decoding
+ *
+ * Reported strings stay valid while the spans and the arena do.
+ */
+class params_reader {
+public:
+  params_reader(arena& scratch);
+  void reset();
+
+  template <typename Handler>
+  bool feed(const string_ref& s, Handler& h);
+
+  bool complete() const;
+
+private:
+  static bool sizes(const unsigned char* d, size_t avail,
+    size_t& prefix, size_t& name_len, size_t& value_len);
+
+private:
+  arena& scratch_;
+  arena_string partial_;
+};
+
+
+/*
+ * Builds records in a chain of buffers taken from buffer_pool. Records
+ * never cross buffer boundary. Everything before the record being
+ * appended to is ready to be written out while building continues.
+ */
+class chain_message {
+public:
+  chain_message(uint16_t id, buffer_pool& pool);
+  ~chain_message();
+  void clear();
+
+  chain_message& id(uint16_t id);
+
+  chain_message& begin_request(unsigned int role, unsigned char flags);
+  chain_message& end_request(unsigned int app_status, unsigned char proto_status);
+
+  chain_message& append(unsigned char type, const string_ref& str);
+  chain_message& external(unsigned char type, size_t size);
+  chain_message& end_stream(unsigned char type);
+  chain_message& seal();
+
+  chain_message& add_param(const string_ref& name, const string_ref& value);
+
+  chain_message& get_values(const values& v);
+  chain_message& get_values_result(const values& v);
+  chain_message& unknown_type(unsigned char type);
+
+  size_t drop(uint16_t id);
+
+  size_t iov(struct iovec* v, size_t n) const;
+  size_t ready() const;
+  size_t size() const;
+  size_t consumed() const;
+  void consume(size_t n);
+
+  bool good() const;
+  operator bool() const;
+
+private:
+  chain_message(const chain_message&);
+  chain_message& operator=(const chain_message&);
+
+  struct chunk {
+    chunk* next;
+    size_t size;
+
+    char* data() { return (char*)(this + 1); }
+  };
+
+  header* add_header(unsigned char type, bool force = false, size_t size = 0);
+  header* add_management(unsigned char type, size_t size);
+  size_t room() const;
+  bool add_chunk();
+
+private:
+  uint16_t id_;
+  buffer_pool& pool_;
+  size_t capacity_;
+  chunk* head_;
+  chunk* tail_;
+  size_t offset_;
+  header* cur_header_;
+  size_t size_;
+  size_t consumed_;
+  bool good_;
+};
+
+
 inline
 uint16_t header::size() const {
   return (uint16_t)((contentLengthB1 << 8) + contentLengthB0);
@@ -388,7 +874,25 @@ void header::clear_padding() {
 
 inline
 bool header::valid() const {
-  return version == FCGI_VERSION_1 && type >= FCGI_BEGIN_REQUEST && type < FCGI_MAXTYPE;
+  return version == FCGI_VERSION_1 && type >= FCGI_BEGIN_REQUEST && type <= FCGI_MAXTYPE;
+}
+
+inline
+const begin_request_body* header::begin_request() const {
+  return (const begin_request_body*)data();
+}
+
+inline
+const end_request_body* header::end_request() const {
+  return (const end_request_body*)data();
+}
+
+/*
+ * Body of FCGI_UNKNOWN_TYPE, type is the management record not understood
+ */
+inline
+const FCGI_UnknownTypeBody* header::unknown_type() const {
+  return (const FCGI_UnknownTypeBody*)data();
 }
 
 inline
@@ -500,79 +1004,449 @@ param& param::write(size_t s) {
 inline
 param& param::write(const string_ref& s) {
   unsigned char* d = data();
-  memcpy(d, s.data(), s.size());
+  if (s.size()) memcpy(d, s.data(), s.size());
   d += s.size();
   return *((param*)d);
 }
 
 
 inline
-message::message(uint16_t id, char* buf, size_t capacity) :
-  id_(id), buf_(buf), capacity_(capacity), cur_header_( (header*)buf_ ),
-  good_(capacity >= sizeof(FCGI_Header) + sizeof(FCGI_EndRequestBody)),
-  terminated_(false) {
-  cur_header_->type = 0;
+values::values() {
+  clear();
 }
 
 inline
-void message::clear() {
-  cur_header_ = (header*)buf_;
-  cur_header_->type = 0;
-  good_ = capacity_ >= sizeof(FCGI_Header) + sizeof(FCGI_EndRequestBody);
-  terminated_ = false;
+void values::clear() {
+  has_ = 0;
+  memset(values_, 0, sizeof(values_));
 }
 
+/*
+ * Name goes to query without value
+ */
 inline
-message& message::id(uint16_t id) {
-  id_ = id;
+values& values::ask(name n) {
+  has_ |= 1u << n;
+  values_[n] = 0;
   return *this;
 }
 
 inline
-message& message::begin_request(unsigned int role, unsigned char flags) {
-  header* h = add_header(FCGI_BEGIN_REQUEST, true, sizeof(FCGI_BeginRequestBody));
-  if (h) {
-    begin_request_body* res = (begin_request_body*)h->data();
-    res->role(role);
-    res->flags = flags;
-    res->reserved[0] = res->reserved[1] = res->reserved[2] =
-    res->reserved[3] = res->reserved[4] = 0;
-    h->clear_padding();
-  }
+values& values::set(name n, size_t v) {
+  has_ |= 1u << n;
+  values_[n] = v;
   return *this;
 }
 
 inline
-message& message::end_request(unsigned int app_status, unsigned char proto_status) {
-  header* h = add_header(FCGI_END_REQUEST, true, sizeof(FCGI_EndRequestBody));
-  if (h) {
-    end_request_body* res = (end_request_body*)h->data();
-    res->app_status(app_status);
-    res->protocolStatus = proto_status;
-    res->reserved[0] = res->reserved[1] = res->reserved[2] = 0;
-    h->clear_padding();
-  }
-  return *this;
+bool values::has(name n) const {
+  return has_ & (1u << n);
 }
 
+/*
+ * 0 when absent or not a number
+ */
 inline
-message& message::append(unsigned char type, const string_ref& str) {
-  header* h = add_header(type);
-  if (h) {
-    if (h->data() + h->size() + str.size() > terminator()) {
-      overflow();
-    } else
-      h->append(str);
-  }
-  return *this;
+size_t values::get(name n) const {
+  return values_[n];
 }
 
+/*
+ * Content of FCGI_GET_VALUES or FCGI_GET_VALUES_RESULT record. False
+ * when pairs do not cover it exactly; those before the damage are taken.
+ */
 inline
-message& message::clear_padding() {
-  if (good_ && cur_header_->type) {
-    cur_header_->clear_padding();
-  }
-  return *this;
+bool values::parse(const string_ref& content) {
+  clear();
+  size_t parsed = 0;
+  const_params q(content);
+  for(const_params::iterator i = q.begin(); i != q.end(); ++i) {
+    string_ref name, value;
+    i->read(name, value);
+    parsed += i->size();
+
+    for(unsigned int n = 0; n < count; ++n) {
+      if (name != str((values::name)n)) continue;
+      size_t v = 0;
+      for(size_t k = 0; k < value.size() && k < 18; ++k) {
+        if (value[k] < '0' || value[k] > '9') {
+          v = 0;
+          break;
+        }
+        v = v * 10 + (value[k] - '0');
+      }
+      set((values::name)n, v);
+    }
+  }
+  return parsed == content.size();
+}
+
+/*
+ * Bytes write() takes
+ */
+inline
+size_t values::size(bool with_values) const {
+  size_t res = 0;
+  char digits[24];
+  for(unsigned int n = 0; n < count; ++n) {
+    if (!has((name)n)) continue;
+    res += 2 + str((name)n).size();
+    if (with_values) res += format(digits, values_[n]);
+  }
+  return res;
+}
+
+/*
+ * Encodes present variables as pairs, returns end of written
+ */
+inline
+char* values::write(char* buf, bool with_values) const {
+  char digits[24];
+  for(unsigned int n = 0; n < count; ++n) {
+    if (!has((name)n)) continue;
+    size_t len = with_values ? format(digits, values_[n]) : 0;
+    param* p = (param*)buf;
+    buf = (char*)&p->write(str((name)n), string_ref(digits, len));
+  }
+  return buf;
+}
+
+inline
+string_ref values::str(name n) {
+  static const string_ref names[count] = {
+    string_ref(FCGI_MAX_CONNS, sizeof(FCGI_MAX_CONNS) - 1),
+    string_ref(FCGI_MAX_REQS, sizeof(FCGI_MAX_REQS) - 1),
+    string_ref(FCGI_MPXS_CONNS, sizeof(FCGI_MPXS_CONNS) - 1)
+  };
+  return names[n];
+}
+
+inline
+size_t values::format(char* buf, size_t v) {
+  char tmp[24];
+  size_t len = 0;
+  do {
+    tmp[len++] = (char)('0' + v % 10);
+    v /= 10;
+  } while(v);
+  for(size_t i = 0; i < len; ++i) buf[i] = tmp[len - 1 - i];
+  return len;
+}
+
+
+inline
+params_index::params_index() {
+  clear();
+}
+
+inline
+void params_index::clear() {
+  memset(hashes_, 0, sizeof(hashes_));
+  memset(known_, 0, sizeof(known_));
+  size_ = 0;
+  good_ = true;
+}
+
+inline
+bool params_index::build(const const_params& p) {
+  clear();
+  for(const_params::iterator i = p.begin(); i != p.end(); ++i) {
+    string_ref name, value;
+    i->read(name, value);
+    add(name, value);
+  }
+  return good_;
+}
+
+/*
+ * Later value of repeated name wins
+ */
+inline
+bool params_index::add(const string_ref& name, const string_ref& value) {
+  uint32_t h = hash(name);
+  size_t i = h % capacity;
+  for(; hashes_[i]; i = (i + 1) % capacity) {
+    if (hashes_[i] == h && entries_[i].name == name) {
+      entries_[i].value = value;
+      return true;
+    }
+  }
+  if (size_ == max_size) {
+    good_ = false;
+    return false;
+  }
+
+  hashes_[i] = h;
+  entries_[i].name = name;
+  entries_[i].value = value;
+  ++size_;
+
+  int k = classify(name);
+  if (k >= 0) known_[k] = (unsigned char)(i + 1);
+  return true;
+}
+
+/*
+ * Lets params_reader fill the index directly
+ */
+inline
+bool params_index::on_param(const string_ref& name, const string_ref& value) {
+  return add(name, value);
+}
+
+inline
+bool params_index::has(known k) const {
+  return known_[k] != 0;
+}
+
+inline
+string_ref params_index::get(known k) const {
+  if (!known_[k]) return string_ref();
+  return entries_[known_[k] - 1].value;
+}
+
+inline
+bool params_index::find(const string_ref& name, string_ref& value) const {
+  uint32_t h = hash(name);
+  for(size_t i = h % capacity; hashes_[i]; i = (i + 1) % capacity) {
+    if (hashes_[i] == h && entries_[i].name == name) {
+      value = entries_[i].value;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline
+size_t params_index::size() const {
+  return size_;
+}
+
+/*
+ * False when some params did not fit and are missing from the table
+ */
+inline
+bool params_index::good() const {
+  return good_;
+}
+
+inline
+string_ref params_index::name(known k) {
+  static const char* const names[known_count] = {
+    "QUERY_STRING", "REQUEST_METHOD", "CONTENT_TYPE", "CONTENT_LENGTH",
+    "SCRIPT_NAME", "SCRIPT_FILENAME", "REQUEST_URI", "DOCUMENT_URI",
+    "DOCUMENT_ROOT", "SERVER_PROTOCOL", "REQUEST_SCHEME", "HTTPS",
+    "GATEWAY_INTERFACE", "SERVER_SOFTWARE", "REMOTE_ADDR", "REMOTE_PORT",
+    "REMOTE_USER", "SERVER_ADDR", "SERVER_PORT", "SERVER_NAME",
+    "REDIRECT_STATUS", "PATH_INFO", "PATH_TRANSLATED", "AUTH_TYPE",
+    "HTTP_HOST", "HTTP_COOKIE", "HTTP_USER_AGENT", "HTTP_ACCEPT",
+    "HTTP_ACCEPT_ENCODING", "HTTP_ACCEPT_LANGUAGE", "HTTP_REFERER",
+    "HTTP_AUTHORIZATION"
+  };
+  return string_ref(names[k]);
+}
+
+/*
+ * Perfect hash of known names: (s[3] + 9 * s[len - 2] + 25 * len) % 64
+ * gives a distinct slot to each of them. Returns known or -1.
+ */
+inline
+int params_index::classify(const string_ref& name) {
+  static const signed char slots[64] = {
+    -1, -1, 28, 29, 15, 26, 14, -1, -1, 12, 6, 18, -1, 17, -1, 16,
+    2, 4, -1, -1, 9, -1, -1, -1, -1, 31, -1, -1, 24, 11, 19, 21,
+    -1, 8, -1, 7, -1, -1, 3, -1, 10, 30, -1, -1, 22, -1, -1, 13,
+    -1, -1, -1, 27, 25, 5, -1, -1, -1, 23, 1, -1, 0, 20, -1, -1
+  };
+
+  size_t l = name.size();
+  if (l < 4) return -1;
+
+  const unsigned char* d = (const unsigned char*)name.data();
+  int k = slots[(d[3] + 9 * d[l - 2] + 25 * l) % 64];
+  if (k < 0 || name != params_index::name((known)k)) return -1;
+  return k;
+}
+
+/*
+ * FNV-1a, never 0 as 0 marks free slot
+ */
+inline
+uint32_t params_index::hash(const string_ref& s) {
+  uint32_t h = 2166136261u;
+  for(size_t i = 0; i < s.size(); ++i) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h | 1;
+}
+
+
+inline
+parser::parser() :
+  pos_(0), seen_(0), good_(true) {
+}
+
+inline
+void parser::reset() {
+  pos_ = 0;
+  seen_ = 0;
+  good_ = true;
+}
+
+/*
+ * buf[0..size) must contain the bytes passed on the previous call (less
+ * those released with consume()) followed by the newly received ones.
+ * Parsing resumes at the first incomplete record, so every header is
+ * validated once and every content byte is reported once:
+ *
+ *   h.on_header(hdr)          - record header is complete and valid
+ *   h.on_content(hdr, chunk)  - next piece of record content arrived
+ *   h.on_record(hdr)          - whole record (with padding) is in buf
+ *
+ * A callback returning false stops parsing and marks parser as failed.
+ */
+template <typename Handler>
+inline
+bool parser::parse(const char* buf, size_t size, Handler& h) {
+  while(good_ && size - pos_ >= sizeof(FCGI_Header)) {
+    const header* r = (const header*)(buf + pos_);
+    size_t avail = size - pos_;
+
+    if (seen_ == 0) {
+      if (!r->valid() || !h.on_header(*r)) {
+        good_ = false;
+        break;
+      }
+      seen_ = sizeof(FCGI_Header);
+    }
+
+    size_t content_end = sizeof(FCGI_Header) + r->size();
+    if (seen_ < content_end && avail > seen_) {
+      size_t e = avail < content_end ? avail : content_end;
+      if (!h.on_content(*r, string_ref(buf + pos_ + seen_, e - seen_))) {
+        good_ = false;
+        break;
+      }
+      seen_ = e;
+    }
+
+    size_t record_end = content_end + r->paddingLength;
+    if (avail < record_end) break;
+
+    if (!h.on_record(*r)) {
+      good_ = false;
+      break;
+    }
+    pos_ += record_end;
+    seen_ = 0;
+  }
+  return good_;
+}
+
+inline
+size_t parser::parsed() const {
+  return pos_;
+}
+
+inline
+void parser::consume(size_t n) {
+  pos_ -= n;
+}
+
+inline
+bool parser::good() const {
+  return good_;
+}
+
+inline
+parser::operator bool() const {
+  return good_;
+}
+
+
+inline
+message::message(uint16_t id, char* buf, size_t capacity) :
+  id_(id), buf_(buf), capacity_(capacity), cur_header_( (header*)buf_ ),
+  good_(capacity >= sizeof(FCGI_Header) + sizeof(FCGI_EndRequestBody)),
+  terminated_(false) {
+  cur_header_->type = 0;
+}
+
+inline
+void message::clear() {
+  cur_header_ = (header*)buf_;
+  cur_header_->type = 0;
+  good_ = capacity_ >= sizeof(FCGI_Header) + sizeof(FCGI_EndRequestBody);
+  terminated_ = false;
+}
+
+inline
+message& message::id(uint16_t id) {
+  id_ = id;
+  return *this;
+}
+
+inline
+message& message::begin_request(unsigned int role, unsigned char flags) {
+  header* h = add_header(FCGI_BEGIN_REQUEST, true, sizeof(FCGI_BeginRequestBody));
+  if (h) {
+    begin_request_body* res = (begin_request_body*)h->data();
+    res->role(role);
+    res->flags = flags;
+    res->reserved[0] = res->reserved[1] = res->reserved[2] =
+    res->reserved[3] = res->reserved[4] = 0;
+    h->clear_padding();
+  }
+  return *this;
+}
+
+inline
+message& message::end_request(unsigned int app_status, unsigned char proto_status) {
+  header* h = add_header(FCGI_END_REQUEST, true, sizeof(FCGI_EndRequestBody));
+  if (h) {
+    end_request_body* res = (end_request_body*)h->data();
+    res->app_status(app_status);
+    res->protocolStatus = proto_status;
+    res->reserved[0] = res->reserved[1] = res->reserved[2] = 0;
+    h->clear_padding();
+  }
+  return *this;
+}
+
+/*
+ * Fills current record up to FCGI_MAX_LENGTH, then continues in a new
+ * record of the same type.
+ */
+inline
+message& message::append(unsigned char type, const string_ref& str) {
+  const char* d = str.data();
+  size_t left = str.size();
+
+  header* h = add_header(type);
+  while(h) {
+    size_t n = FCGI_MAX_LENGTH - h->size();
+    if (n > left) n = left;
+
+    if (h->data() + h->size() + n > terminator()) {
+      overflow();
+      break;
+    }
+    h->append(string_ref(d, n));
+    d += n;
+    left -= n;
+
+    if (!left) break;
+    h = add_header(type, true);
+  }
+  return *this;
+}
+
+inline
+message& message::clear_padding() {
+  if (good_ && cur_header_->type) {
+    cur_header_->clear_padding();
+  }
+  return *this;
 }
 
 inline
@@ -583,21 +1457,74 @@ message& message::end_stream(unsigned char type) {
   return *this;
 }
 
+/*
+ * Pair that does not fit in current record starts a new one, only pairs
+ * longer than FCGI_MAX_LENGTH span records
+ */
 inline
 message& message::add_param(const string_ref& name, const string_ref& value) {
-  header* h = add_header(FCGI_PARAMS);
+  unsigned char sizes[8];
+  param* s = (param*)sizes;
+  size_t sizes_len = (unsigned char*)&s->write(name.size()).write(value.size()) - sizes;
+  size_t len = sizes_len + name.size() + value.size();
+
+  // current record takes the pair unless it is too full for the whole of it
+  header* h = cur_header_;
+  bool fresh = h->type == FCGI_PARAMS && len <= FCGI_MAX_LENGTH
+    && h->size() + len > FCGI_MAX_LENGTH;
+  if (!good_ || h->type != FCGI_PARAMS || fresh) h = add_header(FCGI_PARAMS, fresh);
   if (h) {
-    if (h->data() + h->size() + name.size() + value.size() > terminator()) {
+    if (h->size() + len > FCGI_MAX_LENGTH) {
+      // longer than any record, let it span records
+      append(FCGI_PARAMS, string_ref((const char*)sizes, sizes_len))
+        .append(FCGI_PARAMS, name)
+        .append(FCGI_PARAMS, value);
+    } else if (h->data() + h->size() + len > terminator()) {
       overflow();
     } else {
       param* p = (param*)(h->data() + h->size());
       p->write(name, value);
-      h->size( h->size() + p->size() );
+      h->size( h->size() + len );
     }
   }
   return *this;
 }
 
+/*
+ * Management records go with FCGI_NULL_REQUEST_ID whatever id() is
+ */
+inline
+message& message::get_values(const values& v) {
+  header* h = add_management(FCGI_GET_VALUES, v.size(false));
+  if (h) {
+    v.write(h->data(), false);
+    h->clear_padding();
+  }
+  return *this;
+}
+
+inline
+message& message::get_values_result(const values& v) {
+  header* h = add_management(FCGI_GET_VALUES_RESULT, v.size(true));
+  if (h) {
+    v.write(h->data(), true);
+    h->clear_padding();
+  }
+  return *this;
+}
+
+inline
+message& message::unknown_type(unsigned char type) {
+  header* h = add_management(FCGI_UNKNOWN_TYPE, sizeof(FCGI_UnknownTypeBody));
+  if (h) {
+    FCGI_UnknownTypeBody* b = (FCGI_UnknownTypeBody*)h->data();
+    memset(b, 0, sizeof(*b));
+    b->type = type;
+    h->clear_padding();
+  }
+  return *this;
+}
+
 inline
 const char* message::data() const {
   return buf_;
@@ -662,6 +1589,20 @@ header* message::add_header(unsigned char type, bool force, size_t size) {
   return cur_header_;
 }
 
+/*
+ * Fixed size record of FCGI_NULL_REQUEST_ID
+ */
+inline
+header* message::add_management(unsigned char type, size_t size) {
+  if (good_ && !cur_header_->type && sizeof(FCGI_Header) + size + 7 > capacity_) {
+    good_ = false;
+    return 0;
+  }
+  header* h = add_header(type, true, size);
+  if (h) h->id(FCGI_NULL_REQUEST_ID);
+  return h;
+}
+
 inline
 char* message::terminator() const {
   header* h = (header*) buf_;
@@ -685,4 +1626,909 @@ void message::overflow() {
   good_ = false;
 }
 
+
+inline
+iov_message::iov_message(uint16_t id, char* buf, size_t capacity,
+  struct iovec* iov, size_t iovcnt) :
+  id_(id), buf_(buf), capacity_(capacity), used_(0),
+  iov_(iov), iov_capacity_(iovcnt), first_(0), last_(0), size_(0),
+  good_(true) {
+}
+
+inline
+void iov_message::clear() {
+  used_ = 0;
+  first_ = last_ = 0;
+  size_ = 0;
+  good_ = true;
+}
+
+inline
+iov_message& iov_message::id(uint16_t id) {
+  id_ = id;
+  return *this;
+}
+
+inline
+iov_message& iov_message::append(unsigned char type, const string_ref& str) {
+  size_t off = 0;
+  while(good_ && off < str.size()) {
+    size_t n = str.size() - off;
+    if (n > FCGI_MAX_LENGTH) n = FCGI_MAX_LENGTH;
+
+    header* h = add_header(type, n);
+    if (!h) break;
+    if (!add_iov(str.data() + off, n)) break;
+    if (h->paddingLength) {
+      char* p = side(h->paddingLength);
+      if (p) memset(p, 0, h->paddingLength);
+    }
+    off += n;
+  }
+  return *this;
+}
+
+inline
+iov_message& iov_message::end_stream(unsigned char type) {
+  add_header(type, 0);
+  return *this;
+}
+
+inline
+iov_message& iov_message::end_request(unsigned int app_status, unsigned char proto_status) {
+  header* h = add_header(FCGI_END_REQUEST, sizeof(FCGI_EndRequestBody));
+  if (h) {
+    char* d = side(sizeof(FCGI_EndRequestBody));
+    if (d) {
+      end_request_body* res = (end_request_body*)d;
+      res->app_status(app_status);
+      res->protocolStatus = proto_status;
+      res->reserved[0] = res->reserved[1] = res->reserved[2] = 0;
+    }
+  }
+  return *this;
+}
+
+inline
+const struct iovec* iov_message::iov() const {
+  return iov_ + first_;
+}
+
+inline
+size_t iov_message::iovcnt() const {
+  return last_ - first_;
+}
+
+inline
+size_t iov_message::size() const {
+  return size_;
+}
+
+/*
+ * Drops n bytes already written from the front, e.g. after partial writev()
+ */
+inline
+void iov_message::consume(size_t n) {
+  size_ -= n;
+  while(n && first_ < last_) {
+    struct iovec& v = iov_[first_];
+    if (n < v.iov_len) {
+      v.iov_base = (char*)v.iov_base + n;
+      v.iov_len -= n;
+      break;
+    }
+    n -= v.iov_len;
+    ++first_;
+  }
+}
+
+inline
+bool iov_message::good() const {
+  return good_;
+}
+
+inline
+iov_message::operator bool() const {
+  return good_;
+}
+
+inline
+header* iov_message::add_header(unsigned char type, size_t size) {
+  header* h = (header*)side(sizeof(FCGI_Header));
+  if (h) {
+    h->version = FCGI_VERSION_1;
+    h->type = type;
+    h->id(id_);
+    h->size(size);
+    h->reserved = 0;
+  }
+  return h;
+}
+
+/*
+ * Reserves n bytes in side buffer. Consecutive side buffer pieces (padding
+ * of one record and header of the next one) share single iovec.
+ */
+inline
+char* iov_message::side(size_t n) {
+  if (!good_) return 0;
+  if (used_ + n > capacity_) {
+    good_ = false;
+    return 0;
+  }
+
+  char* p = buf_ + used_;
+  if (last_ > first_ && (char*)iov_[last_ - 1].iov_base + iov_[last_ - 1].iov_len == p) {
+    iov_[last_ - 1].iov_len += n;
+    size_ += n;
+  } else if (!add_iov(p, n)) {
+    return 0;
+  }
+  used_ += n;
+  return p;
+}
+
+inline
+bool iov_message::add_iov(const char* p, size_t n) {
+  if (last_ == iov_capacity_) {
+    good_ = false;
+    return false;
+  }
+  iov_[last_].iov_base = (void*)p;
+  iov_[last_].iov_len = n;
+  ++last_;
+  size_ += n;
+  return true;
+}
+
+
+inline
+buffer_pool::buffer_pool(size_t buffer_size, size_t max_free) :
+  buffer_size_(buffer_size < sizeof(node) ? sizeof(node) : buffer_size),
+  max_free_(max_free), free_count_(0), free_(0),
+  in_use_(0), peak_(0), large_in_use_(0), large_peak_(0) {
+}
+
+inline
+buffer_pool::~buffer_pool() {
+  while(free_) {
+    node* n = free_;
+    free_ = n->next;
+    ::free(n);
+  }
+}
+
+inline
+char* buffer_pool::alloc() {
+  char* b;
+  if (free_) {
+    node* n = free_;
+    free_ = n->next;
+    --free_count_;
+    b = (char*)n;
+  } else {
+    b = (char*)malloc(buffer_size_);
+    if (!b) return 0;
+  }
+  if (++in_use_ > peak_) peak_ = in_use_;
+  return b;
+}
+
+inline
+void buffer_pool::free(char* b) {
+  --in_use_;
+  if (free_count_ >= max_free_) {
+    ::free(b);
+    return;
+  }
+  node* n = (node*)b;
+  n->next = free_;
+  free_ = n;
+  ++free_count_;
+}
+
+/*
+ * Returns count buffers linked through their first word at once
+ */
+inline
+void buffer_pool::free_chain(char* head, char* tail, size_t count) {
+  if (free_count_ + count > max_free_) {
+    while(head) {
+      char* n = (char*)((node*)head)->next;
+      free(head);
+      head = n;
+    }
+    return;
+  }
+  ((node*)tail)->next = free_;
+  free_ = (node*)head;
+  free_count_ += count;
+  in_use_ -= count;
+}
+
+inline
+char* buffer_pool::alloc_large(size_t size) {
+  char* b = (char*)malloc(size);
+  if (b) {
+    large_in_use_ += size;
+    if (large_in_use_ > large_peak_) large_peak_ = large_in_use_;
+  }
+  return b;
+}
+
+inline
+void buffer_pool::free_large(char* b, size_t size) {
+  large_in_use_ -= size;
+  ::free(b);
+}
+
+inline
+size_t buffer_pool::buffer_size() const {
+  return buffer_size_;
+}
+
+/*
+ * Buffers handed out now
+ */
+inline
+size_t buffer_pool::in_use() const {
+  return in_use_;
+}
+
+/*
+ * High-water mark of in_use()
+ */
+inline
+size_t buffer_pool::peak() const {
+  return peak_;
+}
+
+/*
+ * Buffers kept in free list
+ */
+inline
+size_t buffer_pool::cached() const {
+  return free_count_;
+}
+
+/*
+ * Bytes of large allocations handed out now
+ */
+inline
+size_t buffer_pool::large_in_use() const {
+  return large_in_use_;
+}
+
+inline
+size_t buffer_pool::large_peak() const {
+  return large_peak_;
+}
+
+
+inline
+arena::arena(buffer_pool& pool) :
+  pool_(pool), chunks_(0), last_(0), count_(0), pos_(0), end_(0),
+  large_(0), size_(0) {
+}
+
+inline
+arena::~arena() {
+  clear();
+}
+
+/*
+ * Memory is 8 bytes aligned, 0 when out of memory
+ */
+inline
+void* arena::alloc(size_t n) {
+  n = (n + 7) & ~(size_t)7;
+
+  size_t chunk_space = pool_.buffer_size() - sizeof(chunk);
+  if (n > chunk_space / 4) {
+    large* l = (large*)pool_.alloc_large(sizeof(large) + n);
+    if (!l) return 0;
+    l->next = large_;
+    l->size = sizeof(large) + n;
+    large_ = l;
+    size_ += n;
+    return l + 1;
+  }
+
+  if ((size_t)(end_ - pos_) < n) {
+    chunk* c = (chunk*)pool_.alloc();
+    if (!c) return 0;
+    // newest buffer goes first, last_ stays the oldest one
+    c->next = chunks_;
+    chunks_ = c;
+    if (!last_) last_ = c;
+    ++count_;
+    pos_ = (char*)(c + 1);
+    end_ = (char*)c + pool_.buffer_size();
+  }
+
+  void* p = pos_;
+  pos_ += n;
+  size_ += n;
+  return p;
+}
+
+/*
+ * Grows the most recent allocation p of size bytes by n bytes in place
+ */
+inline
+bool arena::extend(void* p, size_t size, size_t n) {
+  size_t s = (size + 7) & ~(size_t)7;
+  if ((char*)p + s != pos_) return false;
+
+  size_t e = ((size + n + 7) & ~(size_t)7) - s;
+  if ((size_t)(end_ - pos_) < e) return false;
+
+  pos_ += e;
+  size_ += e;
+  return true;
+}
+
+inline
+string_ref arena::copy(const string_ref& s) {
+  char* p = (char*)alloc(s.size());
+  if (!p) return string_ref();
+  memcpy(p, s.data(), s.size());
+  return string_ref(p, s.size());
+}
+
+inline
+void arena::clear() {
+  if (chunks_) pool_.free_chain((char*)chunks_, (char*)last_, count_);
+  while(large_) {
+    large* l = large_;
+    large_ = l->next;
+    pool_.free_large((char*)l, l->size);
+  }
+  chunks_ = last_ = 0;
+  count_ = 0;
+  pos_ = end_ = 0;
+  size_ = 0;
+}
+
+/*
+ * Bytes handed out since last clear()
+ */
+inline
+size_t arena::size() const {
+  return size_;
+}
+
+
+inline
+arena_string::arena_string() :
+  data_(0), size_(0), capacity_(0) {
+}
+
+/*
+ * Grows in place while it is the latest allocation of arena,
+ * otherwise doubles capacity
+ */
+inline
+bool arena_string::append(arena& a, const string_ref& s) {
+  if (size_ + s.size() > capacity_) {
+    size_t more = size_ + s.size() - capacity_;
+    if (data_ && a.extend(data_, capacity_, more)) {
+      capacity_ += more;
+    } else {
+      size_t c = capacity_ ? capacity_ * 2 : 256;
+      if (c < size_ + s.size()) c = size_ + s.size();
+
+      char* d = (char*)a.alloc(c);
+      if (!d) return false;
+      if (size_) memcpy(d, data_, size_);
+      data_ = d;
+      capacity_ = c;
+    }
+  }
+  memcpy(data_ + size_, s.data(), s.size());
+  size_ += s.size();
+  return true;
+}
+
+/*
+ * Empties string, memory is kept for next appends
+ */
+inline
+void arena_string::rewind() {
+  size_ = 0;
+}
+
+inline
+void arena_string::clear() {
+  data_ = 0;
+  size_ = 0;
+  capacity_ = 0;
+}
+
+inline
+string_ref arena_string::str() const {
+  return string_ref(data_, size_);
+}
+
+inline
+size_t arena_string::size() const {
+  return size_;
+}
+
+
+inline
+params_reader::params_reader(arena& scratch) :
+  scratch_(scratch) {
+}
+
+/*
+ * Forgets a cut pair, call it after scratch arena is cleared too
+ */
+inline
+void params_reader::reset() {
+  partial_.clear();
+}
+
+/*
+ * s is content of next FCGI_PARAMS record. False when handler stops
+ * decoding or scratch arena is out of memory.
+ */
+template <typename Handler>
+inline
+bool params_reader::feed(const string_ref& s, Handler& h) {
+  const unsigned char* d = (const unsigned char*)s.data();
+  size_t left = s.size();
+  size_t prefix, name_len, value_len;
+
+  // finish the pair cut by previous record first
+  while(partial_.size() && left) {
+    string_ref p = partial_.str();
+    const unsigned char* pd = (const unsigned char*)p.data();
+
+    // length prefix itself may be cut, take it byte by byte then
+    size_t n = 1;
+    if (sizes(pd, p.size(), prefix, name_len, value_len)) {
+      n = prefix + name_len + value_len - p.size();
+    }
+    if (n > left) n = left;
+    if (!partial_.append(scratch_, string_ref((const char*)d, n))) return false;
+    d += n;
+    left -= n;
+
+    p = partial_.str();
+    pd = (const unsigned char*)p.data();
+    if (sizes(pd, p.size(), prefix, name_len, value_len)
+      && p.size() == prefix + name_len + value_len) {
+      // the copy stays in arena, only the builder is reset
+      partial_.clear();
+      const char* b = p.data() + prefix;
+      if (!h.on_param(string_ref(b, name_len), string_ref(b + name_len, value_len))) {
+        return false;
+      }
+    }
+  }
+
+  while(left) {
+    if (!sizes(d, left, prefix, name_len, value_len)
+      || left - prefix < name_len || left - prefix - name_len < value_len) {
+      return partial_.append(scratch_, string_ref((const char*)d, left));
+    }
+    const char* b = (const char*)d + prefix;
+    if (!h.on_param(string_ref(b, name_len), string_ref(b + name_len, value_len))) {
+      return false;
+    }
+    d += prefix + name_len + value_len;
+    left -= prefix + name_len + value_len;
+  }
+  return true;
+}
+
+/*
+ * False when stream stopped in the middle of a pair
+ */
+inline
+bool params_reader::complete() const {
+  return partial_.size() == 0;
+}
+
+/*
+ * Decodes both lengths if avail bytes hold the whole prefix
+ */
+inline
+bool params_reader::sizes(const unsigned char* d, size_t avail,
+  size_t& prefix, size_t& name_len, size_t& value_len) {
+  if (avail == 0) return false;
+  size_t n = (d[0] >> 7) ? 4 : 1;
+  if (avail <= n) return false;
+  size_t v = (d[n] >> 7) ? 4 : 1;
+  if (avail < n + v) return false;
+
+  ((const param*)d)->read(name_len).read(value_len);
+  prefix = n + v;
+  return true;
+}
+
+
+inline
+chain_message::chain_message(uint16_t id, buffer_pool& pool) :
+  id_(id), pool_(pool), capacity_(pool.buffer_size() - sizeof(chunk)),
+  head_(0), tail_(0), offset_(0), cur_header_(0), size_(0), consumed_(0),
+  good_(pool.buffer_size() >= sizeof(chunk) + 2 * sizeof(FCGI_Header) + 8) {
+}
+
+inline
+chain_message::~chain_message() {
+  clear();
+}
+
+inline
+void chain_message::clear() {
+  while(head_) {
+    chunk* c = head_;
+    head_ = c->next;
+    pool_.free((char*)c);
+  }
+  tail_ = 0;
+  offset_ = 0;
+  cur_header_ = 0;
+  size_ = 0;
+  consumed_ = 0;
+  good_ = capacity_ >= 2 * sizeof(FCGI_Header) + 8;
+}
+
+/*
+ * Changing id closes current record, so records of several requests
+ * may be interleaved in one chain.
+ */
+inline
+chain_message& chain_message::id(uint16_t id) {
+  if (id != id_) {
+    seal();
+    id_ = id;
+  }
+  return *this;
+}
+
+inline
+chain_message& chain_message::begin_request(unsigned int role, unsigned char flags) {
+  header* h = add_header(FCGI_BEGIN_REQUEST, true, sizeof(FCGI_BeginRequestBody));
+  if (h) {
+    begin_request_body* res = (begin_request_body*)h->data();
+    res->role(role);
+    res->flags = flags;
+    res->reserved[0] = res->reserved[1] = res->reserved[2] =
+    res->reserved[3] = res->reserved[4] = 0;
+    seal();
+  }
+  return *this;
+}
+
+inline
+chain_message& chain_message::end_request(unsigned int app_status, unsigned char proto_status) {
+  header* h = add_header(FCGI_END_REQUEST, true, sizeof(FCGI_EndRequestBody));
+  if (h) {
+    end_request_body* res = (end_request_body*)h->data();
+    res->app_status(app_status);
+    res->protocolStatus = proto_status;
+    res->reserved[0] = res->reserved[1] = res->reserved[2] = 0;
+    seal();
+  }
+  return *this;
+}
+
+/*
+ * Fills current record while buffer has room, then continues in a new
+ * record in the next buffer.
+ */
+inline
+chain_message& chain_message::append(unsigned char type, const string_ref& str) {
+  const char* d = str.data();
+  size_t left = str.size();
+
+  while(left) {
+    header* h = add_header(type);
+    if (!h) break;
+
+    size_t n = room();
+    if (n > (size_t)FCGI_MAX_LENGTH - h->size()) n = FCGI_MAX_LENGTH - h->size();
+    if (n == 0) {
+      seal();
+      continue;
+    }
+    if (n > left) n = left;
+
+    uint16_t s = h->size();
+    memcpy(h->data() + s, d, n);
+    h->size(s + n);
+    tail_->size += n;
+    size_ += n;
+    d += n;
+    left -= n;
+  }
+  return *this;
+}
+
+/*
+ * Record of size content bytes which are not stored in the chain: header
+ * and padding are, with a gap between them at consumed() + size() +
+ * sizeof(FCGI_Header) as seen before the call. Whoever writes the chain
+ * out has to fill the gap, e.g. with sendfile().
+ */
+inline
+chain_message& chain_message::external(unsigned char type, size_t size) {
+  if (size > FCGI_MAX_LENGTH) {
+    good_ = false;
+    return *this;
+  }
+  header* h = add_header(type, true);
+  if (h) {
+    h->size((uint16_t)size);
+    memset(h->data(), 0, h->paddingLength);
+    tail_->size += h->paddingLength;
+    size_ += h->paddingLength;
+    cur_header_ = 0;
+  }
+  return *this;
+}
+
+inline
+chain_message& chain_message::end_stream(unsigned char type) {
+  add_header(type, true);
+  return seal();
+}
+
+/*
+ * Pair that does not fit in current record starts a new one, in the next
+ * buffer when need be. Only pairs no record in a buffer can hold span
+ * records.
+ */
+inline
+chain_message& chain_message::add_param(const string_ref& name, const string_ref& value) {
+  unsigned char sizes[8];
+  param* s = (param*)sizes;
+  size_t sizes_len = (unsigned char*)&s->write(name.size()).write(value.size()) - sizes;
+  size_t len = sizes_len + name.size() + value.size();
+
+  // header and padding take the rest, as in add_header()
+  size_t whole = sizeof(FCGI_Header) + len + 7;
+  size_t left = tail_ ? capacity_ - tail_->size : 0;
+  bool fits = cur_header_ && cur_header_->type == FCGI_PARAMS
+    ? len + 7 <= left && cur_header_->size() + len <= FCGI_MAX_LENGTH
+    : whole <= left;
+  if (!fits && len <= FCGI_MAX_LENGTH && whole <= capacity_) {
+    header* h = add_header(FCGI_PARAMS, true, len);
+    if (h) ((param*)h->data())->write(name, value);
+    return *this;
+  }
+
+  return append(FCGI_PARAMS, string_ref((const char*)sizes, sizes_len))
+    .append(FCGI_PARAMS, name)
+    .append(FCGI_PARAMS, value);
+}
+
+/*
+ * Management records go with FCGI_NULL_REQUEST_ID whatever id() is
+ */
+inline
+chain_message& chain_message::get_values(const values& v) {
+  header* h = add_management(FCGI_GET_VALUES, v.size(false));
+  if (h) {
+    v.write(h->data(), false);
+    seal();
+  }
+  return *this;
+}
+
+inline
+chain_message& chain_message::get_values_result(const values& v) {
+  header* h = add_management(FCGI_GET_VALUES_RESULT, v.size(true));
+  if (h) {
+    v.write(h->data(), true);
+    seal();
+  }
+  return *this;
+}
+
+inline
+chain_message& chain_message::unknown_type(unsigned char type) {
+  header* h = add_management(FCGI_UNKNOWN_TYPE, sizeof(FCGI_UnknownTypeBody));
+  if (h) {
+    FCGI_UnknownTypeBody* b = (FCGI_UnknownTypeBody*)h->data();
+    memset(b, 0, sizeof(*b));
+    b->type = type;
+    seal();
+  }
+  return *this;
+}
+
+/*
+ * Closes current record, everything built so far becomes ready.
+ */
+inline
+chain_message& chain_message::seal() {
+  if (cur_header_) {
+    cur_header_->clear_padding();
+    tail_->size += cur_header_->paddingLength;
+    size_ += cur_header_->paddingLength;
+    cur_header_ = 0;
+  }
+  return *this;
+}
+
+/*
+ * Takes back records of request id none of which bytes are written out
+ * yet, records of others close up behind them. Chain must not have
+ * external() records: their content is not in buffers, so records could
+ * not be walked. Nothing of the chain may be in flight either. Bytes
+ * dropped.
+ */
+inline
+size_t chain_message::drop(uint16_t id) {
+  seal();
+  size_t dropped = 0;
+  chunk* prev = 0;
+  chunk* c = head_;
+  while(c) {
+    // records never cross buffers, each buffer starts with one
+    size_t sent = c == head_ ? offset_ : 0;
+    char* p = c->data();
+    char* end = p + c->size;
+    char* to = p;
+    while(p < end) {
+      const header* h = (const header*)p;
+      size_t len = sizeof(FCGI_Header) + h->size() + h->paddingLength;
+      if (h->id() == id && (size_t)(p - c->data()) >= sent) {
+        dropped += len;
+      } else {
+        if (to != p) memmove(to, p, len);
+        to += len;
+      }
+      p += len;
+    }
+    c->size = to - c->data();
+
+    chunk* next = c->next;
+    if (c->size == sent) {
+      // iov() stops at empty buffer, written out head is one too
+      if (prev) prev->next = next;
+      else head_ = next;
+      if (c == tail_) tail_ = prev;
+      if (sent) offset_ = 0;
+      pool_.free((char*)c);
+    } else {
+      prev = c;
+    }
+    c = next;
+  }
+  size_ -= dropped;
+  return dropped;
+}
+
+/*
+ * Fills up to n iovecs with bytes ready to be written
+ */
+inline
+size_t chain_message::iov(struct iovec* v, size_t n) const {
+  size_t i = 0;
+  size_t off = offset_;
+  for(chunk* c = head_; c && i < n; c = c->next, off = 0) {
+    size_t end = c->size;
+    if (c == tail_ && cur_header_) end = (char*)cur_header_ - c->data();
+    if (end <= off) break;
+
+    v[i].iov_base = c->data() + off;
+    v[i].iov_len = end - off;
+    ++i;
+  }
+  return i;
+}
+
+inline
+size_t chain_message::ready() const {
+  if (!cur_header_) return size_;
+  return size_ - sizeof(FCGI_Header) - cur_header_->size();
+}
+
+inline
+size_t chain_message::size() const {
+  return size_;
+}
+
+/*
+ * Bytes written out and dropped since clear()
+ */
+inline
+size_t chain_message::consumed() const {
+  return consumed_;
+}
+
+/*
+ * Drops n bytes already written from the front, buffers are returned
+ * to pool as soon as they are done.
+ */
+inline
+void chain_message::consume(size_t n) {
+  size_ -= n;
+  consumed_ += n;
+  while(n) {
+    size_t left = head_->size - offset_;
+    if (n < left) {
+      offset_ += n;
+      break;
+    }
+    n -= left;
+    offset_ = 0;
+
+    chunk* c = head_;
+    head_ = c->next;
+    if (c == tail_) tail_ = 0;
+    pool_.free((char*)c);
+  }
+}
+
+inline
+bool chain_message::good() const {
+  return good_;
+}
+
+inline
+chain_message::operator bool() const {
+  return good_;
+}
+
+inline
+header* chain_message::add_header(unsigned char type, bool force, size_t size) {
+  if (!good_) return 0;
+  if (cur_header_ && cur_header_->type == type && !force) return cur_header_;
+
+  seal();
+  // header, body and padding of fixed records, at least 1 byte of stream ones
+  size_t need = sizeof(FCGI_Header) + (size ? size : 1) + 7;
+  if ((!tail_ || capacity_ - tail_->size < need) && !add_chunk()) return 0;
+
+  header* h = (header*)(tail_->data() + tail_->size);
+  h->type = type;
+  h->id(id_);
+  h->version = FCGI_VERSION_1;
+  h->size(size);
+  h->reserved = 0;
+
+  tail_->size += sizeof(FCGI_Header) + size;
+  size_ += sizeof(FCGI_Header) + size;
+  cur_header_ = h;
+  return h;
+}
+
+inline
+header* chain_message::add_management(unsigned char type, size_t size) {
+  header* h = add_header(type, true, size);
+  if (h) h->id(FCGI_NULL_REQUEST_ID);
+  return h;
+}
+
+/*
+ * Content bytes current record may still take in the last buffer,
+ * room for padding is kept.
+ */
+inline
+size_t chain_message::room() const {
+  size_t left = capacity_ - tail_->size;
+  return left > 7 ? left - 7 : 0;
+}
+
+inline
+bool chain_message::add_chunk() {
+  chunk* c = (chunk*)pool_.alloc();
+  if (!c) {
+    good_ = false;
+    return false;
+  }
+  c->next = 0;
+  c->size = 0;
+  if (tail_) tail_->next = c;
+  else head_ = c;
+  tail_ = c;
+  return true;
+}
+
 }
@@ -0,0 +1,466 @@
+/*
+ * Load generator for FastCGI applications, tinyfcgi::client underneath.
+ *
+ *   tinyfcgi-bench [options] path|host:port
+ *
+ *   -c conns      connections per thread (8)
+ *   -m inflight   requests in flight per connection (1), multiplexed on
+ *                 one connection; lowered to what the application tells
+ *                 in FCGI_GET_VALUES, 1 when it does not multiplex
+ *   -t threads    client threads (1), each with its own connections
+ *   -n requests   total number of requests (10000)
+ *   -d seconds    run for given time instead of -n
+ *   -r rate       open loop: send at fixed rate (req/s) and measure from
+ *                 the time a request was due, not when it was sent
+ *   -p name=value add or replace param, may be repeated
+ *   -k bytes      add HTTP_COOKIE of given size
+ *   -b bytes      STDIN body size (0)
+ *
+ * Default params are what nginx sends with stock fastcgi_params for a GET.
+ * Latency is kept in HDR histogram with ~1.5% precision, percentiles are
+ * upper bounds of their buckets.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define WARN(x)  std::cerr << x << std::endl
+
+#define HAVE_BOOST_STRING_REF 1
+#include "tinyfcgi_client.hpp"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using boost::string_ref;
+
+static uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Log-linear histogram: values below 128 are exact, above that every
+ * power of two is split in 64 buckets
+ */
+class histogram {
+public:
+  enum {
+    sub_bits = 6,
+    sub_count = 1 << sub_bits,
+    buckets = (64 - sub_bits) * sub_count + sub_count
+  };
+
+  histogram() : counts_(buckets), total_(0), sum_(0), min_(UINT64_MAX), max_(0) { }
+
+  void record(uint64_t v) {
+    ++counts_[index(v)];
+    ++total_;
+    sum_ += v;
+    if (v < min_) min_ = v;
+    if (v > max_) max_ = v;
+  }
+
+  void add(const histogram& h) {
+    for(size_t i = 0; i < buckets; ++i) counts_[i] += h.counts_[i];
+    total_ += h.total_;
+    sum_ += h.sum_;
+    if (h.min_ < min_) min_ = h.min_;
+    if (h.max_ > max_) max_ = h.max_;
+  }
+
+  uint64_t percentile(double p) const {
+    if (!total_) return 0;
+    uint64_t rank = (uint64_t)(p / 100 * total_ + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < buckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        uint64_t v = highest(i);
+        return v < max_ ? v : max_;
+      }
+    }
+    return max_;
+  }
+
+  uint64_t count() const { return total_; }
+  uint64_t min() const { return total_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return total_ ? (double)sum_ / total_ : 0; }
+
+private:
+  static size_t index(uint64_t v) {
+    if (v < 2 * sub_count) return v;
+    int e = 63 - __builtin_clzll(v) - sub_bits;
+    return e * sub_count + (v >> e);
+  }
+
+  static uint64_t highest(size_t i) {
+    if (i < 2 * sub_count) return i;
+    int e = (int)(i / sub_count) - 1;
+    uint64_t m = i - e * sub_count;
+    return ((m + 1) << e) - 1;
+  }
+
+private:
+  std::vector<uint64_t> counts_;
+  uint64_t total_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+
+struct options {
+  std::string target;
+  size_t conns;
+  size_t inflight;
+  size_t threads;
+  size_t requests;
+  double duration;
+  double rate;
+  std::vector<std::string> params; // names and values interleaved
+  std::string body;
+
+  options() : conns(8), inflight(1), threads(1), requests(10000),
+    duration(0), rate(0) { }
+};
+
+class worker;
+
+/*
+ * One request slot; it is sent again as soon as it is over in closed
+ * loop, or goes back to free list of the worker in open loop
+ */
+class timed_call : public tinyfcgi::call {
+public:
+  timed_call(worker& w, const string_ref* params, size_t count, const string_ref& body) :
+    tinyfcgi::call(params, count, body), start_(0), next_free_(0), worker_(w) { }
+
+  void on_stdout(const string_ref& chunk);
+  void on_end(unsigned int app_status, unsigned char proto_status);
+  void on_error(int err);
+
+  uint64_t start_;
+  timed_call* next_free_;
+
+private:
+  worker& worker_;
+};
+
+/*
+ * Client thread: own tinyfcgi::client, connections and histogram
+ */
+class worker {
+public:
+  worker(const options& o, size_t requests, double rate) :
+    opts_(o), up_(-1), left_(requests), rate_(rate), free_(0),
+    complete_(0), overloaded_(0), failed_(0), app_errors_(0), bytes_(0), deadline_(0) {
+    for(size_t i = 0; i < o.params.size(); ++i) params_.push_back(o.params[i]);
+  }
+
+  ~worker() {
+    for(size_t i = 0; i < calls_.size(); ++i) delete calls_[i];
+  }
+
+  bool connect();
+  void run(uint64_t start);
+
+  bool more() {
+    if (deadline_) return now_ns() < deadline_;
+    if (!left_) return false;
+    --left_;
+    return true;
+  }
+
+  void done(timed_call& t) {
+    latency_.record(now_ns() - t.start_);
+    if (rate_) {
+      t.next_free_ = free_;
+      free_ = &t;
+    } else if (more()) {
+      send(t, now_ns());
+    }
+  }
+
+  void send(timed_call& t, uint64_t due) {
+    t.start_ = due;
+    if (client_.send(up_, t) == -1) ++failed_;
+  }
+
+  timed_call* slot() {
+    if (!free_) {
+      calls_.push_back(new timed_call(*this, &params_[0], params_.size() / 2, opts_.body));
+      return calls_.back();
+    }
+    timed_call* t = free_;
+    free_ = t->next_free_;
+    return t;
+  }
+
+  const options& opts_;
+  std::vector<string_ref> params_;
+  tinyfcgi::client client_;
+  int up_;
+  size_t left_;
+  double rate_;
+  std::vector<timed_call*> calls_;
+  timed_call* free_;
+
+  histogram latency_;
+  size_t complete_;
+  size_t overloaded_;
+  size_t failed_;
+  size_t app_errors_;
+  size_t bytes_;
+  uint64_t deadline_;
+};
+
+
+inline
+void timed_call::on_stdout(const string_ref& chunk) {
+  worker_.bytes_ += chunk.size();
+}
+
+inline
+void timed_call::on_end(unsigned int app_status, unsigned char proto_status) {
+  if (proto_status == FCGI_REQUEST_COMPLETE) {
+    ++worker_.complete_;
+    if (app_status) ++worker_.app_errors_;
+  } else {
+    ++worker_.overloaded_;
+  }
+  worker_.done(*this);
+}
+
+inline
+void timed_call::on_error(int err) {
+  if (!worker_.failed_) WARN("request failed: " << strerror(err));
+  ++worker_.failed_;
+  worker_.done(*this);
+}
+
+
+/*
+ * host:port is TCP, anything else is UNIX socket path
+ */
+inline
+bool worker::connect() {
+  const char* t = opts_.target.c_str();
+  const char* colon = strrchr(t, ':');
+  if (colon) {
+    std::string host(t, colon - t);
+    up_ = client_.upstream_tcp(host.c_str(), atoi(colon + 1), opts_.conns, opts_.inflight);
+  } else {
+    up_ = client_.upstream_unix(t, opts_.conns, opts_.inflight);
+  }
+  if (up_ == -1 || client_.probe(up_) == -1) return false;
+
+  // limits are in before the run; an application not answering within
+  // a second is taken at what options say
+  uint64_t until = now_ns() + 1000000000;
+  while(!client_.probed(up_) && client_.connections(up_) && now_ns() < until) {
+    client_.poll(100);
+  }
+  if (!client_.probed(up_)) WARN("no answer to FCGI_GET_VALUES, limits are not checked");
+  return true;
+}
+
+inline
+void worker::run(uint64_t start) {
+  if (opts_.duration) deadline_ = start + (uint64_t)(opts_.duration * 1e9);
+
+  if (!rate_) {
+    // no more than application takes, the rest would wait in client
+    size_t slots = client_.capacity(up_);
+    for(size_t i = 0; i < slots && more(); ++i) {
+      send(*slot(), now_ns());
+    }
+    while(client_.pending()) client_.poll(-1);
+    return;
+  }
+
+  // requests are due at fixed intervals; late ones are sent at once with
+  // their due time, so a stall shows in latency instead of hiding it
+  uint64_t interval = (uint64_t)(1e9 / rate_);
+  uint64_t due = start;
+  while(true) {
+    uint64_t t = now_ns();
+    while(due <= t && more()) {
+      send(*slot(), due);
+      due += interval;
+    }
+    bool sending = deadline_ ? t < deadline_ : left_ > 0;
+    if (!sending && !client_.pending()) break;
+
+    int timeout = -1;
+    if (sending) timeout = due > t ? (int)((due - t) / 1000000) : 0;
+    client_.poll(timeout);
+  }
+}
+
+
+static void usage(const char* name) {
+  std::cerr << "usage: " << name << " [-c conns] [-m inflight] [-t threads]"
+    " [-n requests | -d seconds] [-r rate] [-p name=value]... [-k cookie_bytes]"
+    " [-b body_bytes] path|host:port" << std::endl;
+}
+
+static void set_param(options& o, const std::string& name, const std::string& value) {
+  for(size_t i = 0; i < o.params.size(); i += 2) {
+    if (o.params[i] == name) {
+      o.params[i + 1] = value;
+      return;
+    }
+  }
+  o.params.push_back(name);
+  o.params.push_back(value);
+}
+
+static void default_params(options& o) {
+  const char* p[] = {
+    "QUERY_STRING", "",
+    "REQUEST_METHOD", "GET",
+    "CONTENT_TYPE", "",
+    "CONTENT_LENGTH", "",
+    "SCRIPT_NAME", "/index.php",
+    "SCRIPT_FILENAME", "/var/www/index.php",
+    "REQUEST_URI", "/index.php",
+    "DOCUMENT_URI", "/index.php",
+    "DOCUMENT_ROOT", "/var/www",
+    "SERVER_PROTOCOL", "HTTP/1.1",
+    "REQUEST_SCHEME", "http",
+    "GATEWAY_INTERFACE", "CGI/1.1",
+    "SERVER_SOFTWARE", "nginx",
+    "REMOTE_ADDR", "127.0.0.1",
+    "REMOTE_PORT", "50000",
+    "SERVER_ADDR", "127.0.0.1",
+    "SERVER_PORT", "80",
+    "SERVER_NAME", "localhost",
+    "REDIRECT_STATUS", "200",
+    "HTTP_HOST", "localhost",
+    "HTTP_USER_AGENT", "tinyfcgi-bench",
+    "HTTP_ACCEPT", "*/*"
+  };
+  for(size_t i = 0; i < sizeof(p) / sizeof(p[0]); i += 2) set_param(o, p[i], p[i + 1]);
+}
+
+static double us(uint64_t ns) {
+  return ns / 1000.0;
+}
+
+int main(int argc, char** argv) {
+  options o;
+  default_params(o);
+
+  size_t cookie = 0;
+  size_t body = 0;
+  bool count_given = false;
+
+  int c;
+  while((c = getopt(argc, argv, "c:m:t:n:d:r:p:k:b:")) != -1) {
+    switch(c) {
+    case 'c': o.conns = strtoul(optarg, 0, 10); break;
+    case 'm': o.inflight = strtoul(optarg, 0, 10); break;
+    case 't': o.threads = strtoul(optarg, 0, 10); break;
+    case 'n': o.requests = strtoul(optarg, 0, 10); count_given = true; break;
+    case 'd': o.duration = atof(optarg); break;
+    case 'r': o.rate = atof(optarg); break;
+    case 'p': {
+      const char* eq = strchr(optarg, '=');
+      if (!eq) {
+        usage(argv[0]);
+        return 1;
+      }
+      set_param(o, std::string(optarg, eq - optarg), eq + 1);
+      break;
+    }
+    case 'k': cookie = strtoul(optarg, 0, 10); break;
+    case 'b': body = strtoul(optarg, 0, 10); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || !o.conns || !o.inflight || !o.threads || (count_given && o.duration)) {
+    usage(argv[0]);
+    return 1;
+  }
+  o.target = argv[optind];
+
+  if (cookie) {
+    std::string v;
+    for(int i = 0; v.size() < cookie; ++i) {
+      if (i) v += "; ";
+      v += "c" + std::to_string(i) + "=" + std::string(64, 'a' + i % 26);
+    }
+    v.resize(cookie);
+    set_param(o, "HTTP_COOKIE", v);
+  }
+  if (body) {
+    o.body.assign(body, 'b');
+    set_param(o, "REQUEST_METHOD", "POST");
+    set_param(o, "CONTENT_TYPE", "application/octet-stream");
+    set_param(o, "CONTENT_LENGTH", std::to_string(body));
+  }
+
+  std::vector<worker*> workers;
+  for(size_t i = 0; i < o.threads; ++i) {
+    size_t n = o.requests / o.threads + (i < o.requests % o.threads ? 1 : 0);
+    workers.push_back(new worker(o, n, o.rate / o.threads));
+    if (!workers.back()->connect()) {
+      std::cerr << "bad upstream " << o.target << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+
+  std::cout << o.target << ": " << o.threads << " threads, " << o.conns << " connections, "
+    << o.inflight << " in flight each";
+  if (o.rate) std::cout << ", " << o.rate << " req/s";
+  std::cout << std::endl;
+
+  uint64_t start = now_ns();
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < workers.size(); ++i) {
+    threads.push_back(std::thread(&worker::run, workers[i], start));
+  }
+  for(size_t i = 0; i < threads.size(); ++i) threads[i].join();
+  double elapsed = (now_ns() - start) / 1e9;
+
+  histogram h;
+  size_t complete = 0, overloaded = 0, failed = 0, app_errors = 0, bytes = 0, capacity = 0;
+  for(size_t i = 0; i < workers.size(); ++i) {
+    worker& w = *workers[i];
+    h.add(w.latency_);
+    complete += w.complete_;
+    overloaded += w.overloaded_;
+    failed += w.failed_;
+    app_errors += w.app_errors_;
+    bytes += w.bytes_;
+    capacity += w.client_.capacity(w.up_);
+  }
+  if (capacity < o.threads * o.conns * o.inflight) {
+    std::cout << "application allows " << capacity << " in flight" << std::endl;
+  }
+
+  std::cout << std::fixed << std::setprecision(2)
+    << h.count() << " requests in " << elapsed << " s, "
+    << std::setprecision(0) << h.count() / elapsed << " req/s, "
+    << std::setprecision(2) << bytes / elapsed / (1 << 20) << " MB/s of stdout" << std::endl
+    << complete << " complete, " << app_errors << " with app_status != 0, "
+    << overloaded << " rejected, " << failed << " failed" << std::endl
+    << "latency us: min " << us(h.min()) << ", mean " << us(h.mean())
+    << ", p50 " << us(h.percentile(50)) << ", p90 " << us(h.percentile(90))
+    << ", p99 " << us(h.percentile(99)) << ", p99.9 " << us(h.percentile(99.9))
+    << ", max " << us(h.max()) << std::endl;
+
+  for(size_t i = 0; i < workers.size(); ++i) delete workers[i];
+  return failed ? 3 : 0;
+}
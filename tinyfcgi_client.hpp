@@ -0,0 +1,1264 @@
+/*
+ * tinyfcgi::client sends requests to FastCGI applications over pools of
+ * keep-alive connections and multiplexes them on one connection when the
+ * application allows it. Non-blocking, driven by edge-triggered epoll
+ * like tinyfcgi::server; one client per thread.
+
+Synopsys
+
+class fetch : public tinyfcgi::call {                                 // one request and its callbacks
+public:
+  fetch(const string_ref* params, size_t count, const string_ref& body) :
+    tinyfcgi::call(params, count, body) { }                           // all of it has to live until the end
+
+  void on_stdout(const string_ref& chunk) { ... }                     // as it arrives
+  void on_end(unsigned int app_status, unsigned char proto_status) { ... }
+  void on_error(int err) { ... }                                      // connection failed
+};
+
+{
+  tinyfcgi::client c;
+  int php = c.upstream_unix("/run/php.sock", 8);                      // up to 8 connections, a request on each
+  int app = c.upstream_tcp("10.0.0.2", 9000, 2, 100);                 // 2 connections, 100 requests on each
+  c.probe(app);                                                       // limits lowered to FCGI_GET_VALUES answer
+
+  string_ref params[] = { "REQUEST_METHOD", "GET", "SCRIPT_FILENAME", "/srv/index.php" };
+  fetch f(params, 2, string_ref());
+  c.send(php, f);                                                     // waits for a free slot if needed
+
+  tinyfcgi::buffered_call b(params, 2);                               // gathers response, polled like a future
+  c.send(app, b);
+
+  int pool[] = { c.upstream_unix("/run/w1.sock", 4, 16),              // limits are lowered to what
+                 c.upstream_unix("/run/w2.sock", 4, 16) };            // FCGI_GET_VALUES tells
+  int workers = c.group(pool, 2, tinyfcgi::client::two_choices);      // or least_outstanding
+  c.send_group(workers, f2);                                          // FCGI_OVERLOADED ejects member
+
+  while(c.pending()) c.poll(-1);                                      // or c.run() until c.stop()
+  std::cout << b.output();
+}
+
+ */
+
+// vim:ts=2:sts=2:sw=2:et
+#pragma once
+
+#include "tinyfcgi.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace tinyfcgi {
+
+class client;
+class client_connection;
+
+
+/*
+ * Request to send, with callbacks for its response. Params are given as
+ * names and values interleaved, count is the number of pairs. Params,
+ * body and the call itself have to stay valid until on_end() or on_error();
+ * the call may be deleted or sent again from there.
+ */
+class call {
+public:
+  call(const string_ref* params, size_t count, const string_ref& body = string_ref());
+  virtual ~call() { }
+
+  virtual void on_stdout(const string_ref& /* chunk */) { }
+  virtual void on_stderr(const string_ref& /* chunk */) { }
+  virtual void on_end(unsigned int app_status, unsigned char proto_status) = 0;
+  virtual void on_error(int err) = 0;
+
+  uint16_t id() const;
+  bool active() const;
+
+private:
+  friend class client;
+  friend class client_connection;
+
+  const string_ref* params_;
+  size_t count_;
+  string_ref body_;
+
+  client_connection* conn_;
+  uint16_t id_;
+  bool active_;
+  call* next_;
+  int group_;
+  size_t tries_;
+};
+
+
+/*
+ * Call keeping the response in memory, done() tells when it is complete
+ */
+class buffered_call : public call {
+public:
+  buffered_call(const string_ref* params, size_t count, const string_ref& body = string_ref());
+
+  void on_stdout(const string_ref& chunk);
+  void on_stderr(const string_ref& chunk);
+  void on_end(unsigned int app_status, unsigned char proto_status);
+  void on_error(int err);
+
+  bool done() const;
+  int error() const;
+  unsigned int app_status() const;
+  unsigned char proto_status() const;
+  const std::string& output() const;
+  const std::string& errors() const;
+
+private:
+  bool done_;
+  int error_;
+  unsigned int app_status_;
+  unsigned char proto_status_;
+  std::string output_;
+  std::string errors_;
+};
+
+
+class client_connection {
+public:
+  client_connection(client& c, size_t upstream, int fd, size_t max_reqs);
+  ~client_connection();
+
+  bool on_readable();
+  bool on_writable();
+
+  bool on_header(const header& h);
+  bool on_content(const header& h, const string_ref& s);
+  bool on_record(const header& h);
+
+  size_t active() const;
+  bool full() const;
+
+  enum {
+    recv_buffer_size = 66 * 1024 // one record of any size fits in
+  };
+
+private:
+  friend class client;
+
+  void start(call* c);
+  call* finish(uint16_t id);
+  void probe();
+  void fail(int err);
+  bool on_values(const header& h);
+  bool parse_input();
+  bool flush();
+
+private:
+  client& client_;
+  size_t upstream_;
+  int fd_;
+  bool connecting_;
+  parser parser_;
+  char* in_;
+  size_t in_size_;
+  chain_message out_;
+  std::vector<call*> calls_;        // by request id
+  std::vector<uint16_t> free_ids_;
+  size_t active_;
+  size_t max_reqs_;                 // lowered when application tells its limits
+  bool probing_;
+  bool dirty_;
+  client_connection* next_dirty_;
+};
+
+
+class client {
+public:
+  client();
+  ~client();
+
+  int upstream_unix(const char* path, size_t max_conns, size_t max_reqs = 1);
+  int upstream_tcp(const char* host, unsigned short port, size_t max_conns,
+    size_t max_reqs = 1);
+
+  enum balance {
+    least_outstanding,
+    two_choices
+  };
+  int group(const int* upstreams, size_t count, balance b = least_outstanding);
+  void eject_time(unsigned int ms);
+  int probe(int upstream);
+
+  int send(int upstream, call& c);
+  int send_group(int group, call& c);
+
+  int poll(int timeout);
+  int run();
+  void stop();
+
+  size_t pending() const;
+  size_t pending(int upstream) const;
+  size_t connections(int upstream) const;
+  size_t capacity(int upstream) const;
+  bool ejected(int upstream) const;
+  bool probed(int upstream) const;
+
+  enum {
+    max_events = 256,
+    default_eject_time = 1000 // ms
+  };
+
+private:
+  friend class client_connection;
+
+  struct upstream {
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    size_t max_conns;
+    size_t max_reqs;
+    std::vector<client_connection*> conns;
+    call* wait_head;
+    call* wait_tail;
+    size_t pending;                 // sent or waiting, not done
+    size_t sent;
+    size_t limit;                   // FCGI_MAX_REQS of application
+    bool probe;                     // ask application for its limits
+    bool probing;
+    bool probed;
+    uint64_t ejected_until;         // ms
+    std::vector<int> groups;
+  };
+
+  struct upstream_group {
+    std::vector<int> members;
+    std::vector<int> candidates;
+    balance policy;
+    size_t next;
+    call* wait_head;
+    call* wait_tail;
+  };
+
+  int add_upstream(const sockaddr* addr, socklen_t len, size_t max_conns, size_t max_reqs);
+  client_connection* pick(upstream& u, size_t index);
+  client_connection* connect_to(upstream& u, size_t index);
+  void pump(size_t index);
+  void done(call* c, size_t index);
+  void fail_waiting(upstream& u, int err);
+  void close_conn(client_connection* c, int err);
+  void dirty(client_connection* c);
+  void flush_dirty();
+
+  void route(int group, call& c);
+  bool dispatch(upstream_group& g, call* c);
+  int choose(upstream_group& g);
+  bool room(const upstream& u) const;
+  size_t capacity(const upstream& u) const;
+  void pump_group(upstream_group& g);
+  bool retry(call* c);
+  void eject(size_t index);
+  void limits(size_t index, size_t conns, size_t reqs, bool mpxs);
+  uint64_t random();
+  static uint64_t now();
+
+private:
+  int epoll_;
+  int wake_;
+  std::atomic<bool> running_;
+  std::vector<upstream*> upstreams_;
+  std::vector<upstream_group*> groups_;
+  unsigned int eject_time_;
+  uint64_t random_;
+  buffer_pool pool_;
+  buffer_pool recv_pool_;
+  client_connection* dirty_;
+  size_t pending_;
+};
+
+
+inline
+call::call(const string_ref* params, size_t count, const string_ref& body) :
+  params_(params), count_(count), body_(body),
+  conn_(0), id_(FCGI_NULL_REQUEST_ID), active_(false), next_(0), group_(-1), tries_(0) {
+}
+
+/*
+ * Request id on its connection while the call is in flight
+ */
+inline
+uint16_t call::id() const {
+  return id_;
+}
+
+/*
+ * Sent or waiting for a connection, not done yet
+ */
+inline
+bool call::active() const {
+  return active_;
+}
+
+
+inline
+buffered_call::buffered_call(const string_ref* params, size_t count, const string_ref& body) :
+  call(params, count, body),
+  done_(false), error_(0), app_status_(0), proto_status_(FCGI_REQUEST_COMPLETE) {
+}
+
+inline
+void buffered_call::on_stdout(const string_ref& chunk) {
+  output_.append(chunk.data(), chunk.size());
+}
+
+inline
+void buffered_call::on_stderr(const string_ref& chunk) {
+  errors_.append(chunk.data(), chunk.size());
+}
+
+inline
+void buffered_call::on_end(unsigned int app_status, unsigned char proto_status) {
+  app_status_ = app_status;
+  proto_status_ = proto_status;
+  done_ = true;
+}
+
+inline
+void buffered_call::on_error(int err) {
+  error_ = err;
+  done_ = true;
+}
+
+inline
+bool buffered_call::done() const {
+  return done_;
+}
+
+/*
+ * errno of connection failure, 0 when response came
+ */
+inline
+int buffered_call::error() const {
+  return error_;
+}
+
+inline
+unsigned int buffered_call::app_status() const {
+  return app_status_;
+}
+
+inline
+unsigned char buffered_call::proto_status() const {
+  return proto_status_;
+}
+
+inline
+const std::string& buffered_call::output() const {
+  return output_;
+}
+
+inline
+const std::string& buffered_call::errors() const {
+  return errors_;
+}
+
+
+inline
+client_connection::client_connection(client& c, size_t upstream, int fd, size_t max_reqs) :
+  client_(c), upstream_(upstream), fd_(fd), connecting_(true), in_(0), in_size_(0),
+  out_(FCGI_NULL_REQUEST_ID, c.pool_), calls_(max_reqs + 1), active_(0),
+  max_reqs_(max_reqs), probing_(false), dirty_(false), next_dirty_(0) {
+  // lowest ids are taken first
+  for(size_t id = max_reqs; id > 0; --id) free_ids_.push_back((uint16_t)id);
+}
+
+inline
+client_connection::~client_connection() {
+  if (in_) client_.recv_pool_.free(in_);
+  close(fd_);
+}
+
+inline
+size_t client_connection::active() const {
+  return active_;
+}
+
+inline
+bool client_connection::full() const {
+  return active_ >= max_reqs_;
+}
+
+/*
+ * Takes a free id and builds the whole request, it goes out with the
+ * next flush together with others started meanwhile
+ */
+inline
+void client_connection::start(call* c) {
+  uint16_t id = free_ids_.back();
+  free_ids_.pop_back();
+  calls_[id] = c;
+  ++active_;
+  c->conn_ = this;
+  c->id_ = id;
+  ++client_.upstreams_[upstream_]->sent;
+
+  out_.id(id).begin_request(FCGI_RESPONDER, FCGI_KEEP_CONN);
+  for(size_t i = 0; i < c->count_; ++i) {
+    out_.add_param(c->params_[i * 2], c->params_[i * 2 + 1]);
+  }
+  out_.end_stream(FCGI_PARAMS);
+  if (c->body_.size()) out_.append(FCGI_STDIN, c->body_);
+  out_.end_stream(FCGI_STDIN);
+  client_.dirty(this);
+}
+
+/*
+ * Frees slot of call which is over
+ */
+inline
+call* client_connection::finish(uint16_t id) {
+  call* c = calls_[id];
+  calls_[id] = 0;
+  free_ids_.push_back(id);
+  --active_;
+  --client_.upstreams_[upstream_]->sent;
+  c->conn_ = 0;
+  c->id_ = FCGI_NULL_REQUEST_ID;
+  client_.done(c, upstream_);
+  return c;
+}
+
+/*
+ * Asks application for its limits, FCGI_GET_VALUES goes out before any
+ * request on this connection
+ */
+inline
+void client_connection::probe() {
+  values q;
+  q.ask(values::max_conns).ask(values::max_reqs).ask(values::mpxs_conns);
+  out_.get_values(q);
+  probing_ = true;
+  client_.dirty(this);
+}
+
+/*
+ * Connection is lost, calls in flight get err. Calls of a group are sent
+ * to another member instead when the connection was never established:
+ * application has not seen them.
+ */
+inline
+void client_connection::fail(int err) {
+  for(size_t id = 1; id < calls_.size(); ++id) {
+    if (!calls_[id]) continue;
+    call* c = finish((uint16_t)id);
+    if (connecting_ && client_.retry(c)) continue;
+    c->on_error(err);
+  }
+}
+
+inline
+bool client_connection::on_readable() {
+  if (!in_ && !(in_ = client_.recv_pool_.alloc())) return false;
+
+  while(true) {
+    ssize_t r = read(fd_, in_ + in_size_, recv_buffer_size - in_size_);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return false;
+    }
+    if (r == 0) {
+      errno = ECONNRESET;
+      return false;
+    }
+    in_size_ += r;
+
+    if (!parse_input()) {
+      errno = EPROTO;
+      return false;
+    }
+  }
+
+  if (!in_size_) {
+    client_.recv_pool_.free(in_);
+    in_ = 0;
+  }
+  return true;
+}
+
+inline
+bool client_connection::on_writable() {
+  if (connecting_) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return false;
+    if (err) {
+      errno = err;
+      return false;
+    }
+    connecting_ = false;
+  }
+  client_.dirty(this);
+  return true;
+}
+
+inline
+bool client_connection::on_header(const header& /* h */) {
+  return true;
+}
+
+inline
+bool client_connection::on_content(const header& h, const string_ref& s) {
+  uint16_t id = h.id();
+  if (id >= calls_.size() || !calls_[id]) return true;
+
+  if (h.type == FCGI_STDOUT) calls_[id]->on_stdout(s);
+  else if (h.type == FCGI_STDERR) calls_[id]->on_stderr(s);
+  return true;
+}
+
+inline
+bool client_connection::on_record(const header& h) {
+  uint16_t id = h.id();
+  if (id == FCGI_NULL_REQUEST_ID) return on_values(h);
+  if (h.type != FCGI_END_REQUEST || id >= calls_.size() || !calls_[id]) return true;
+  if (h.size() < sizeof(FCGI_EndRequestBody)) return false;
+
+  call* c = finish(id);
+  const end_request_body* b = h.end_request();
+  if (b->protocolStatus == FCGI_OVERLOADED) {
+    // rejected before any work, another member of group may take it
+    client_.eject(upstream_);
+    if (client_.retry(c)) {
+      client_.pump(upstream_);
+      return true;
+    }
+  }
+  c->on_end(b->app_status(), b->protocolStatus);
+
+  // slot is free, waiting call may take it
+  client_.pump(upstream_);
+  return true;
+}
+
+/*
+ * FCGI_GET_VALUES_RESULT, or FCGI_UNKNOWN_TYPE from application not
+ * knowing management records; configured limits stay then
+ */
+inline
+bool client_connection::on_values(const header& h) {
+  if (!probing_) return true;
+  if (h.type == FCGI_UNKNOWN_TYPE) {
+    if (h.size() < sizeof(FCGI_UnknownTypeBody)) return false;
+    if (h.unknown_type()->type != FCGI_GET_VALUES) return true;
+  } else if (h.type != FCGI_GET_VALUES_RESULT) {
+    return true;
+  }
+  probing_ = false;
+
+  values v;
+  if (h.type == FCGI_GET_VALUES_RESULT) v.parse(h.str());
+  bool mpxs = !v.has(values::mpxs_conns) || v.get(values::mpxs_conns) != 0;
+  client_.limits(upstream_, v.get(values::max_conns), v.get(values::max_reqs), mpxs);
+  return true;
+}
+
+/*
+ * Parses receive buffer, drops complete records from it
+ */
+inline
+bool client_connection::parse_input() {
+  if (!parser_.parse(in_, in_size_, *this)) return false;
+
+  size_t done = parser_.parsed();
+  memmove(in_, in_ + done, in_size_ - done);
+  in_size_ -= done;
+  parser_.consume(done);
+  return true;
+}
+
+inline
+bool client_connection::flush() {
+  if (!out_) {
+    errno = ENOMEM;
+    return false;
+  }
+  if (connecting_) return true;
+
+  out_.seal();
+  while(out_.size()) {
+    struct iovec v[64];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = out_.iov(v, 64);
+
+    ssize_t r = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      return false;
+    }
+    out_.consume(r);
+  }
+  return true;
+}
+
+
+inline
+client::client() :
+  epoll_(epoll_create1(EPOLL_CLOEXEC)),
+  wake_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), running_(true),
+  eject_time_(default_eject_time), random_(now() ^ (uintptr_t)this),
+  recv_pool_(client_connection::recv_buffer_size, 64), dirty_(0), pending_(0) {
+  if (epoll_ != -1 && wake_ != -1) {
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = 0;
+    epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &ev);
+  }
+}
+
+/*
+ * Calls still in flight are dropped without callbacks
+ */
+inline
+client::~client() {
+  for(size_t i = 0; i < upstreams_.size(); ++i) {
+    upstream* u = upstreams_[i];
+    for(size_t j = 0; j < u->conns.size(); ++j) delete u->conns[j];
+    delete u;
+  }
+  for(size_t i = 0; i < groups_.size(); ++i) delete groups_[i];
+  if (wake_ != -1) close(wake_);
+  if (epoll_ != -1) close(epoll_);
+}
+
+/*
+ * Application on UNIX socket. Up to max_conns connections are kept open,
+ * each carries up to max_reqs requests at once: 1 for applications not
+ * multiplexing connections (FCGI_MPXS_CONNS=0). Index of upstream or -1.
+ */
+inline
+int client::upstream_unix(const char* path, size_t max_conns, size_t max_reqs) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  return add_upstream((const sockaddr*)&addr, sizeof(addr), max_conns, max_reqs);
+}
+
+/*
+ * Application on TCP, host is resolved once here
+ */
+inline
+int client::upstream_tcp(const char* host, unsigned short port, size_t max_conns,
+  size_t max_reqs) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", (unsigned int)port);
+
+  addrinfo* ai = 0;
+  if (getaddrinfo(host, service, &hints, &ai) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  int r = add_upstream(ai->ai_addr, ai->ai_addrlen, max_conns, max_reqs);
+  freeaddrinfo(ai);
+  return r;
+}
+
+/*
+ * Group of upstreams serving the same application, send_group() picks a
+ * member for every call. Members are asked for FCGI_MAX_CONNS,
+ * FCGI_MAX_REQS and FCGI_MPXS_CONNS on first connection and get no more
+ * calls than that at once; calls over capacity of all members wait in
+ * the group. Member answering FCGI_OVERLOADED or failing to connect is
+ * ejected for eject_time() and its call goes to another member. Upstream
+ * may be in several groups. Index of group or -1.
+ */
+inline
+int client::group(const int* members, size_t count, balance b) {
+  if (count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  for(size_t i = 0; i < count; ++i) {
+    if (members[i] < 0 || (size_t)members[i] >= upstreams_.size()) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  upstream_group* g = new upstream_group;
+  g->members.assign(members, members + count);
+  g->policy = b;
+  g->next = 0;
+  g->wait_head = g->wait_tail = 0;
+  groups_.push_back(g);
+
+  int index = (int)groups_.size() - 1;
+  for(size_t i = 0; i < count; ++i) {
+    upstream& u = *upstreams_[members[i]];
+    u.groups.push_back(index);
+    u.probe = true;
+  }
+  return index;
+}
+
+/*
+ * Asks application for its limits with FCGI_GET_VALUES on a connection
+ * opened now, as group members are asked; upstream limits are lowered to
+ * the answer. Calls sent meanwhile are not held back, poll until probed()
+ * to have all of them within the limits.
+ */
+inline
+int client::probe(int index) {
+  if (index < 0 || (size_t)index >= upstreams_.size()) {
+    errno = EINVAL;
+    return -1;
+  }
+  upstream& u = *upstreams_[index];
+  u.probe = true;
+  if (u.probed || u.probing) return 0;
+
+  if (!u.conns.empty()) {
+    u.conns[0]->probe();
+    u.probing = true;
+    return 0;
+  }
+  return connect_to(u, index) ? 0 : -1;
+}
+
+/*
+ * How long ejected upstream gets no calls from groups
+ */
+inline
+void client::eject_time(unsigned int ms) {
+  eject_time_ = ms;
+}
+
+/*
+ * Starts call on a connection of upstream with a free slot, opening one
+ * if the limit allows, otherwise queues it until a slot is freed. Failure
+ * to connect is reported through on_error(), maybe from here.
+ */
+inline
+int client::send(int index, call& c) {
+  if (index < 0 || (size_t)index >= upstreams_.size() || c.active_) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  upstream& u = *upstreams_[index];
+  c.active_ = true;
+  c.next_ = 0;
+  ++u.pending;
+  ++pending_;
+
+  if (u.wait_head) {
+    // keep order, earlier calls go first
+    u.wait_tail->next_ = &c;
+    u.wait_tail = &c;
+    return 0;
+  }
+
+  client_connection* conn = pick(u, index);
+  if (conn) {
+    conn->start(&c);
+    return 0;
+  }
+  if (u.conns.empty()) {
+    // connect failed, no slot is going to be freed either
+    done(&c, index);
+    c.on_error(errno);
+    return 0;
+  }
+  u.wait_head = u.wait_tail = &c;
+  return 0;
+}
+
+/*
+ * Starts call on the member of group chosen by its balance policy, or
+ * queues it in group while no member has room. Fails through on_error()
+ * when no member can be connected to.
+ */
+inline
+int client::send_group(int index, call& c) {
+  if (index < 0 || (size_t)index >= groups_.size() || c.active_) {
+    errno = EINVAL;
+    return -1;
+  }
+  c.tries_ = 0;
+  route(index, c);
+  return 0;
+}
+
+/*
+ * Handles events for up to timeout ms (-1 waits) and sends what has been
+ * built meanwhile. Number of events or -1.
+ */
+inline
+int client::poll(int timeout) {
+  flush_dirty();
+
+  epoll_event events[max_events];
+  int n = epoll_wait(epoll_, events, max_events, timeout);
+  if (n == -1) return errno == EINTR ? 0 : -1;
+
+  for(int i = 0; i < n; ++i) {
+    const epoll_event& ev = events[i];
+    client_connection* c = (client_connection*)ev.data.ptr;
+    if (!c) {
+      uint64_t v;
+      ssize_t r = read(wake_, &v, sizeof(v));
+      (void)r;
+      continue;
+    }
+
+    bool ok = true;
+    if (ev.events & EPOLLOUT) ok = c->on_writable();
+    if (ok && (ev.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) ok = c->on_readable();
+    if (!ok) close_conn(c, errno ? errno : ECONNRESET);
+  }
+
+  flush_dirty();
+  return n;
+}
+
+inline
+int client::run() {
+  while(running_.load(std::memory_order_relaxed)) {
+    if (poll(-1) == -1) return -1;
+  }
+  return 0;
+}
+
+/*
+ * Safe to call from any thread, run() returns after current iteration
+ */
+inline
+void client::stop() {
+  running_.store(false, std::memory_order_relaxed);
+  uint64_t one = 1;
+  ssize_t r = write(wake_, &one, sizeof(one));
+  (void)r;
+}
+
+/*
+ * Calls sent or waiting and not done yet
+ */
+inline
+size_t client::pending() const {
+  return pending_;
+}
+
+inline
+size_t client::pending(int index) const {
+  return upstreams_[index]->pending;
+}
+
+inline
+size_t client::connections(int index) const {
+  return upstreams_[index]->conns.size();
+}
+
+/*
+ * Calls upstream takes at once, as configured or as told by application
+ */
+inline
+size_t client::capacity(int index) const {
+  return capacity(*upstreams_[index]);
+}
+
+inline
+bool client::ejected(int index) const {
+  return upstreams_[index]->ejected_until > now();
+}
+
+/*
+ * Application answered FCGI_GET_VALUES, or told it does not know it
+ */
+inline
+bool client::probed(int index) const {
+  return upstreams_[index]->probed;
+}
+
+inline
+int client::add_upstream(const sockaddr* addr, socklen_t len, size_t max_conns, size_t max_reqs) {
+  if (max_conns == 0 || max_reqs == 0 || len > sizeof(sockaddr_storage)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  upstream* u = new upstream;
+  memcpy(&u->addr, addr, len);
+  u->addr_len = len;
+  u->max_conns = max_conns;
+  u->max_reqs = max_reqs < 0xffff ? max_reqs : 0xffff;
+  u->wait_head = u->wait_tail = 0;
+  u->pending = 0;
+  u->sent = 0;
+  u->limit = (size_t)-1;
+  u->probe = u->probing = u->probed = false;
+  u->ejected_until = 0;
+  upstreams_.push_back(u);
+  return (int)upstreams_.size() - 1;
+}
+
+/*
+ * Idle connection, or a new one while the limit allows, or the least
+ * loaded one with a free slot. 0 when there is none, errno is set when
+ * connect failed.
+ */
+inline
+client_connection* client::pick(upstream& u, size_t index) {
+  if (u.sent >= u.limit) return 0;
+
+  client_connection* best = 0;
+  for(size_t i = 0; i < u.conns.size(); ++i) {
+    client_connection* c = u.conns[i];
+    if (!c->full() && (!best || c->active() < best->active())) best = c;
+  }
+  if (best && best->active() == 0) return best;
+
+  if (u.conns.size() < u.max_conns) {
+    client_connection* c = connect_to(u, index);
+    if (c) return c;
+  }
+  return best;
+}
+
+inline
+client_connection* client::connect_to(upstream& u, size_t index) {
+  int fd = socket(u.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) return 0;
+
+  if (u.addr.ss_family != AF_UNIX) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  if (connect(fd, (const sockaddr*)&u.addr, u.addr_len) == -1 && errno != EINPROGRESS) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return 0;
+  }
+
+  client_connection* c = new client_connection(*this, index, fd, u.max_reqs);
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    int e = errno;
+    delete c;
+    errno = e;
+    return 0;
+  }
+  u.conns.push_back(c);
+
+  if (u.probe && !u.probed && !u.probing) {
+    c->probe();
+    u.probing = true;
+  }
+  return c;
+}
+
+/*
+ * Moves waiting calls to free slots, calls sent to upstream itself go
+ * before those of its groups
+ */
+inline
+void client::pump(size_t index) {
+  upstream& u = *upstreams_[index];
+  while(u.wait_head) {
+    client_connection* conn = pick(u, index);
+    if (!conn) {
+      // nothing left to wait for when upstream is unreachable
+      if (u.conns.empty()) fail_waiting(u, errno);
+      break;
+    }
+    call* c = u.wait_head;
+    u.wait_head = c->next_;
+    if (!u.wait_head) u.wait_tail = 0;
+    c->next_ = 0;
+    conn->start(c);
+  }
+
+  for(size_t i = 0; i < u.groups.size() && !u.wait_head; ++i) pump_group(*groups_[u.groups[i]]);
+}
+
+/*
+ * Call is over, counters go down before its callback runs
+ */
+inline
+void client::done(call* c, size_t index) {
+  c->active_ = false;
+  --upstreams_[index]->pending;
+  --pending_;
+}
+
+inline
+void client::fail_waiting(upstream& u, int err) {
+  size_t index = 0;
+  while(upstreams_[index] != &u) ++index;
+
+  while(u.wait_head) {
+    call* c = u.wait_head;
+    u.wait_head = c->next_;
+    if (!u.wait_head) u.wait_tail = 0;
+    c->next_ = 0;
+    done(c, index);
+    c->on_error(err);
+  }
+}
+
+/*
+ * Connection failed or was closed by application. Idle keep-alive
+ * connections are closed by applications at will, that is not an error.
+ */
+inline
+void client::close_conn(client_connection* c, int err) {
+  upstream& u = *upstreams_[c->upstream_];
+  for(size_t i = 0; i < u.conns.size(); ++i) {
+    if (u.conns[i] == c) {
+      u.conns[i] = u.conns.back();
+      u.conns.pop_back();
+      break;
+    }
+  }
+  if (c->dirty_) {
+    client_connection** p = &dirty_;
+    while(*p != c) p = &(*p)->next_dirty_;
+    *p = c->next_dirty_;
+  }
+
+  size_t index = c->upstream_;
+  if (c->probing_) u.probing = false;
+  if (err && (c->connecting_ || c->active_)) eject(index);
+  c->fail(err);
+  delete c;
+  pump(index);
+}
+
+/*
+ * Connection has output to send, all requests started during a loop
+ * iteration go out in one write at its end
+ */
+inline
+void client::dirty(client_connection* c) {
+  if (c->dirty_) return;
+  c->dirty_ = true;
+  c->next_dirty_ = dirty_;
+  dirty_ = c;
+}
+
+inline
+void client::flush_dirty() {
+  while(dirty_) {
+    client_connection* c = dirty_;
+    dirty_ = c->next_dirty_;
+    c->dirty_ = false;
+    if (!c->flush()) close_conn(c, errno);
+  }
+}
+
+/*
+ * Counts call and starts or queues it, sent again after a retry too
+ */
+inline
+void client::route(int index, call& c) {
+  upstream_group& g = *groups_[index];
+  c.group_ = index;
+  c.active_ = true;
+  c.next_ = 0;
+  ++pending_;
+
+  if (g.wait_head) {
+    g.wait_tail->next_ = &c;
+    g.wait_tail = &c;
+    return;
+  }
+  if (!dispatch(g, &c)) g.wait_head = g.wait_tail = &c;
+}
+
+/*
+ * Starts call on a member with room, false when there is none. Member
+ * failing to connect is ejected and next one is tried, once every member
+ * has been tried the call fails.
+ */
+inline
+bool client::dispatch(upstream_group& g, call* c) {
+  while(true) {
+    int index = choose(g);
+    if (index == -1) return false;
+
+    upstream& u = *upstreams_[index];
+    errno = 0;
+    client_connection* conn = pick(u, index);
+    ++c->tries_;
+    if (conn) {
+      ++u.pending;
+      conn->start(c);
+      return true;
+    }
+    if (!errno) return false;
+
+    int err = errno;
+    eject(index);
+    if (c->tries_ >= g.members.size()) {
+      c->active_ = false;
+      --pending_;
+      c->on_error(err);
+      return true;
+    }
+  }
+}
+
+/*
+ * Member with room taking the call: the one with fewest outstanding
+ * calls, or the better of two random ones. Ejected members are skipped
+ * unless all are ejected. -1 when no member has room.
+ */
+inline
+int client::choose(upstream_group& g) {
+  uint64_t t = now();
+  bool healthy = false;
+  for(size_t i = 0; i < g.members.size() && !healthy; ++i) {
+    healthy = upstreams_[g.members[i]]->ejected_until <= t;
+  }
+
+  g.candidates.clear();
+  for(size_t i = 0; i < g.members.size(); ++i) {
+    const upstream& u = *upstreams_[g.members[i]];
+    if ((!healthy || u.ejected_until <= t) && room(u)) g.candidates.push_back(g.members[i]);
+  }
+
+  size_t n = g.candidates.size();
+  if (n == 0) return -1;
+
+  if (g.policy == two_choices && n > 2) {
+    size_t a = random() % n;
+    size_t b = random() % (n - 1);
+    if (b >= a) ++b;
+    int ia = g.candidates[a], ib = g.candidates[b];
+    return upstreams_[ia]->pending <= upstreams_[ib]->pending ? ia : ib;
+  }
+
+  // ties go round robin
+  size_t start = g.next++ % n;
+  int best = -1;
+  for(size_t i = 0; i < n; ++i) {
+    int m = g.candidates[(start + i) % n];
+    if (best == -1 || upstreams_[m]->pending < upstreams_[best]->pending) best = m;
+  }
+  return best;
+}
+
+/*
+ * Member not asked for its limits yet gets one call at a time
+ */
+inline
+bool client::room(const upstream& u) const {
+  if (u.wait_head) return false;
+  return u.sent < (u.probe && !u.probed ? 1 : capacity(u));
+}
+
+inline
+size_t client::capacity(const upstream& u) const {
+  size_t n = u.max_conns * u.max_reqs;
+  return n < u.limit ? n : u.limit;
+}
+
+inline
+void client::pump_group(upstream_group& g) {
+  while(g.wait_head) {
+    call* c = g.wait_head;
+    g.wait_head = c->next_;
+    if (!g.wait_head) g.wait_tail = 0;
+    c->next_ = 0;
+
+    if (!dispatch(g, c)) {
+      c->next_ = g.wait_head;
+      g.wait_head = c;
+      if (!g.wait_tail) g.wait_tail = c;
+      return;
+    }
+  }
+}
+
+/*
+ * Sends call of a group again, to another member unless all have been
+ * tried. Call must be done already.
+ */
+inline
+bool client::retry(call* c) {
+  if (c->group_ == -1 || c->tries_ >= groups_[c->group_]->members.size()) return false;
+  route(c->group_, *c);
+  return true;
+}
+
+inline
+void client::eject(size_t index) {
+  upstreams_[index]->ejected_until = now() + eject_time_;
+}
+
+/*
+ * Answer to FCGI_GET_VALUES, 0 is unknown. Connections already open keep
+ * their number of requests lowered to the new one.
+ */
+inline
+void client::limits(size_t index, size_t conns, size_t reqs, bool mpxs) {
+  upstream& u = *upstreams_[index];
+  u.probing = false;
+  u.probed = true;
+
+  if (conns && conns < u.max_conns) u.max_conns = conns;
+  if (!mpxs) u.max_reqs = 1;
+  else if (reqs && reqs < u.max_reqs) u.max_reqs = reqs;
+  if (reqs) u.limit = reqs;
+
+  for(size_t i = 0; i < u.conns.size(); ++i) {
+    client_connection* c = u.conns[i];
+    if (c->max_reqs_ > u.max_reqs) c->max_reqs_ = u.max_reqs;
+  }
+  pump(index);
+}
+
+/*
+ * xorshift64, good enough to pick members
+ */
+inline
+uint64_t client::random() {
+  random_ ^= random_ << 13;
+  random_ ^= random_ >> 7;
+  random_ ^= random_ << 17;
+  return random_;
+}
+
+inline
+uint64_t client::now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+}
@@ -0,0 +1,210 @@
+/*
+ * Coroutine handlers for tinyfcgi::server, needs C++20. A handler is
+ * written as one coroutine per request; it is resumed by the event loop
+ * of the server thread, nothing blocks and no thread is held per request.
+
+Synopsys
+
+class echo : public tinyfcgi::coroutine_handler {
+public:
+  tinyfcgi::task<void> handle(tinyfcgi::request& r) {                 // started once params are in
+    co_await r.write_stdout("Content-Type: text/plain\r\n\r\n");
+
+    string_ref chunk;
+    while(!(chunk = co_await r.read_stdin()).empty()) {               // body as it arrives, valid until
+      if (!co_await r.write_stdout(chunk)) co_return;                 // next co_await; suspends over high
+    }                                                                 // watermark, false when peer is gone
+    co_await log(r);                                                  // tasks await other tasks
+    r.end_request(0);                                                 // or ended with 0 on return
+  }
+
+  tinyfcgi::task<void> log(tinyfcgi::request& r);
+};
+
+{
+  echo h;
+  tinyfcgi::server s(h);
+  ...
+}
+
+ */
+
+// vim:ts=2:sts=2:sw=2:et
+#pragma once
+
+#include "tinyfcgi_server.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+
+namespace tinyfcgi {
+
+/*
+ * Coroutine frames are recycled through a pool of the thread running
+ * them. Every server loop runs in one thread and resumes only its own
+ * requests, so frames are not allocated from heap once the pool is warm.
+ * Frames larger than frame_size are allocated on their own.
+ */
+class frame_pool {
+public:
+  static void* alloc(size_t size);
+  static void free(void* p, size_t size);
+
+  static const buffer_pool& pool();
+
+  enum {
+    frame_size = 1024,
+    max_free = 4096
+  };
+
+private:
+  static buffer_pool& local();
+};
+
+
+/*
+ * Part of promise common to all tasks: frame allocation, lazy start and
+ * return to the awaiting coroutine when done
+ */
+class task_promise_base {
+public:
+  static void* operator new(size_t size) { return frame_pool::alloc(size); }
+  static void operator delete(void* p, size_t size) { frame_pool::free(p, size); }
+
+  std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      return h.promise().continuation_;
+    }
+    void await_resume() noexcept { }
+  };
+
+  final_awaiter final_suspend() noexcept { return final_awaiter(); }
+  void unhandled_exception() { std::terminate(); }
+
+  std::coroutine_handle<> continuation_ = std::noop_coroutine();
+};
+
+
+template <typename T>
+class task_promise : public task_promise_base {
+public:
+  template <typename U>
+  void return_value(U&& v) { value_.emplace(std::forward<U>(v)); }
+  T result() { return std::move(*value_); }
+
+private:
+  std::optional<T> value_;
+};
+
+template <>
+class task_promise<void> : public task_promise_base {
+public:
+  void return_void() { }
+  void result() { }
+};
+
+
+/*
+ * Lazily started coroutine, runs when awaited and resumes its awaiter
+ * when done. Owns its frame.
+ */
+template <typename T = void>
+class task {
+public:
+  class promise_type : public task_promise<T> {
+  public:
+    task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+  };
+
+  task(task&& t) noexcept : h_(t.h_) { t.h_ = 0; }
+  ~task() { if (h_) h_.destroy(); }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    h_.promise().continuation_ = awaiter;
+    return h_;
+  }
+  T await_resume() { return h_.promise().result(); }
+
+private:
+  explicit task(std::coroutine_handle<promise_type> h) : h_(h) { }
+
+  task(const task&);
+  task& operator=(const task&);
+
+private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+
+/*
+ * Runs handle() for every request as soon as its params are complete,
+ * STDIN is streamed to it through read_stdin(). Request not ended when
+ * the coroutine returns is ended with app_status 0. Suspended coroutine
+ * is resumed when what it waits for comes, or right away when the request
+ * is aborted; it must not outlive the request in other ways.
+ */
+class coroutine_handler : public handler {
+public:
+  virtual task<void> handle(request& r) = 0;
+
+  void on_params(request& r) {
+    r.stream_input();
+    run(r);
+  }
+  void on_request(request& /* r */) { }
+
+private:
+  // top-level coroutine: starts at once, frees its frame when done
+  struct detached {
+    struct promise_type : task_promise_base {
+      detached get_return_object() { return detached(); }
+      std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+      std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+      void return_void() { }
+    };
+  };
+
+  detached run(request& r) {
+    co_await handle(r);
+    if (!r.ended()) r.end_request(0);
+  }
+};
+
+
+inline
+void* frame_pool::alloc(size_t size) {
+  buffer_pool& p = local();
+  void* f = size <= frame_size ? p.alloc() : p.alloc_large(size);
+  if (!f) throw std::bad_alloc();
+  return f;
+}
+
+inline
+void frame_pool::free(void* p, size_t size) {
+  if (size <= frame_size) local().free((char*)p);
+  else local().free_large((char*)p, size);
+}
+
+/*
+ * Counters of the calling thread's pool
+ */
+inline
+const buffer_pool& frame_pool::pool() {
+  return local();
+}
+
+inline
+buffer_pool& frame_pool::local() {
+  thread_local buffer_pool p(frame_size, max_free);
+  return p;
+}
+
+}
@@ -0,0 +1,2892 @@
+/*
+ * tinyfcgi::server is a non-blocking FastCGI application engine built on
+ * edge-triggered epoll and the wrappers from tinyfcgi.hpp
+
+Synopsys
+
+class hello : public tinyfcgi::handler {
+public:
+  void on_request(tinyfcgi::request& r) {                             // called when STDIN is terminated
+    for(const tinyfcgi::request::pair* p = r.params(); p; p = p->next) {  // enum params in arrival order
+      std::cout << p->name << ": " << p->value << std::endl;
+    }
+    r.param(tinyfcgi::params_index::REQUEST_URI);                     // or look them up in O(1)
+
+    r.write("Content-Type: text/plain\r\n\r\n")                       // append FCGI_STDOUT
+      .write("Hello")
+      .write_file(open("footer.txt", O_RDONLY), 0, footer_size);      // zero-copy with sendfile(), fd is closed after
+    r.end_request(0);                                                 // terminate streams and request
+  }                                                                   // output goes out once per loop iteration,
+                                                                      // pipelined responses share one write
+};
+
+class export_csv : public tinyfcgi::handler {                         // streaming with flow control
+public:
+  void on_request(tinyfcgi::request& r) {
+    r.write("Content-Type: text/csv\r\n\r\n");
+    on_drain(r);
+  }
+  void on_drain(tinyfcgi::request& r) {                               // output queue fell under low watermark
+    while(r.writable()) {                                             // false over high watermark
+      if (!next_row(r)) return r.end_request(0);
+    }
+  }
+  void on_abort(tinyfcgi::request& r) {                               // FCGI_ABORT_REQUEST or connection lost,
+    drop_cursor(r);                                                   // r.aborted() is true, r is gone after
+  }
+};
+
+class upload : public tinyfcgi::handler {                             // body in constant memory
+public:
+  void on_params(tinyfcgi::request& r) {                              // params are in, STDIN is not
+    if (r.content_length() > 1 << 20) r.stream_input();               // checked against received STDIN
+  }
+  void on_input(tinyfcgi::request& r, const string_ref& chunk) {      // points into receive buffer
+    store(r, chunk);
+  }
+  void on_request(tinyfcgi::request& r) {                             // STDIN is over
+    store(r, r.input());                                              // empty when streamed
+    r.end_request(0);
+  }
+};
+
+{
+  hello h;
+  tinyfcgi::server s(h);
+
+  s.listen_unix("sock", 1024);
+  s.use_uring();                                                      // optional, -1 and epoll stays if kernel lacks it
+  s.watermarks(1 << 20, 256 * 1024);                                  // bytes queued per connection
+  s.limits(1000, 4000);                                               // connections, requests; told
+                                                                      // to web servers asking FCGI_GET_VALUES
+  s.params_limit(32 * 1024);                                          // PARAMS bytes per request, more get 431
+  s.admission(64, 256);                                               // requests in handler, queued; the
+                                                                      // rest and stale queue get FCGI_OVERLOADED
+  s.stats_path("/tinyfcgi-stats");                                    // SCRIPT_NAME answered with metrics
+                                                                      // in Prometheus text, or s.collect(stats)
+  s.run();                                                            // serve until stop()
+}
+
+ */
+
+// vim:ts=2:sts=2:sw=2:et
+#pragma once
+
+#include "tinyfcgi.hpp"
+#include "tinyfcgi_uring.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tinyfcgi {
+
+class connection;
+class server;
+
+
+class request {
+public:
+  struct pair {
+    string_ref name;
+    string_ref value;
+    pair* next;
+  };
+
+  /*
+   * Awaitables for coroutine handlers, see tinyfcgi_coro.hpp. Suspended
+   * coroutine is resumed by the engine on the event it waits for, or when
+   * the request is aborted; awaits on an ended request do not suspend.
+   */
+  struct stdin_awaiter {
+    request& r;
+
+    bool await_ready() const { return !r.streaming_ || r.ended_ || r.input_done_ || r.input_.size(); }
+    template <typename Handle> void await_suspend(Handle h) { r.wait(h.address(), &resume<Handle>, true); }
+    string_ref await_resume() { return r.take_input(); }
+  };
+
+  struct stdout_awaiter {
+    request& r;
+
+    bool await_ready() const { return r.ended_ || !r.paused_; }
+    template <typename Handle> void await_suspend(Handle h) { r.wait(h.address(), &resume<Handle>, false); }
+    bool await_resume() const { return !r.aborted_; }
+  };
+
+  static const size_t no_length = (size_t)-1;
+
+  request(buffer_pool& pool);
+
+  uint16_t id() const;
+  unsigned int role() const;
+  unsigned char flags() const;
+  bool keep_conn() const;
+
+  const pair* params() const;
+  string_ref param(params_index::known k) const;
+  string_ref param(const string_ref& name) const;
+  string_ref input() const;
+
+  void stream_input();
+  size_t content_length() const;
+  size_t input_size() const;
+
+  request& append(unsigned char type, const string_ref& str);
+  request& write(const string_ref& str);
+  request& write_file(int fd, off_t offset, size_t size);
+  void end_request(unsigned int app_status,
+    unsigned char proto_status = FCGI_REQUEST_COMPLETE);
+
+  stdin_awaiter read_stdin();
+  stdout_awaiter write_stdout(const string_ref& str);
+
+  bool active() const;
+  bool ended() const;
+  bool aborted() const;
+  bool writable();
+
+  tinyfcgi::arena& arena();
+
+private:
+  friend class connection;
+  friend class server;
+  friend class params_reader;
+
+  void begin(connection* c, uint16_t id, const begin_request_body& b);
+  void clear();
+  bool on_param(const string_ref& name, const string_ref& value);
+  string_ref take_input();
+  void wait(void* coroutine, void (*resume)(void*), bool input);
+  bool wake();
+
+  template <typename Handle>
+  static void resume(void* h) { Handle::from_address(h).resume(); }
+
+private:
+  connection* conn_;
+  uint16_t id_;
+  unsigned int role_;
+  unsigned char flags_;
+  bool active_;
+  bool ended_;
+  bool aborted_;
+  bool dispatched_;
+  bool stdout_;
+  bool stderr_;
+  bool paused_;
+  bool params_done_;
+  bool streaming_;
+  bool input_done_;
+  bool input_taken_;
+  bool input_wait_;
+  bool admitted_;
+  bool queued_;
+  void* waiter_;
+  void (*resume_)(void*);
+  size_t content_length_;
+  size_t received_;
+  string_ref chunk_;
+  string_ref record_;               // PARAMS record being decoded
+  size_t params_size_;
+  tinyfcgi::arena arena_;
+  params_reader reader_;
+  pair* params_;
+  pair* last_param_;
+  params_index index_;
+  arena_string input_;
+  request* next_free_;
+  uint64_t queued_at_;              // ns
+  request* prev_queued_;
+  request* next_queued_;
+  uint64_t begun_at_;               // ns
+  uint64_t started_at_;             // ns, 0 until handler sees it
+  size_t records_;
+  int outcome_;                     // metrics::counter END_REQUEST counts in
+};
+
+
+/*
+ * Requests of one connection in open addressing table keyed by request id,
+ * FCGI_NULL_REQUEST_ID marks free slot. Web servers use small sequential
+ * ids, so requests nearly always sit in their home slot.
+ */
+class request_table {
+public:
+  request_table();
+
+  request* find(uint16_t id) const;
+  bool insert(uint16_t id, request* r);
+  request* erase(uint16_t id);
+
+  size_t size() const;
+  request* at(size_t slot) const;
+
+  enum {
+    capacity = 64
+  };
+
+private:
+  request_table(const request_table&);
+  request_table& operator=(const request_table&);
+
+private:
+  uint16_t ids_[capacity];
+  request* reqs_[capacity];
+  size_t size_;
+};
+
+
+class handler {
+public:
+  virtual ~handler() { }
+  virtual void on_request(request& r) = 0;
+  virtual void on_params(request& /* r */) { }
+  virtual void on_input(request& /* r */, const string_ref& /* chunk */) { }
+  virtual void on_drain(request& /* r */) { }
+  virtual void on_abort(request& /* r */) { }
+};
+
+
+class connection {
+public:
+  connection(server& s, int fd);
+  ~connection();
+
+  int fd() const;
+
+  bool on_readable();
+  bool on_writable();
+  bool on_data(const char* data, size_t size);
+
+  bool on_header(const header& h);
+  bool on_content(const header& h, const string_ref& s);
+  bool on_record(const header& h);
+
+  enum {
+    recv_buffer_size = 66 * 1024, // one record of any size fits in
+    max_iov = 64
+  };
+
+  static const size_t file_record = FCGI_MAX_LENGTH & ~7; // needs no padding
+
+private:
+  friend class request;
+  friend class server;
+
+  /*
+   * File content going to gaps left in out_ by chain_message::external(),
+   * one gap per record, gaps of one file are sizeof(FCGI_Header) apart
+   */
+  struct file {
+    int fd;
+    off_t offset;
+    size_t left;                    // of the whole file
+    size_t at;                      // out_ position of current gap
+    size_t gap;                     // bytes left in current gap
+    file* next;
+  };
+
+  bool on_management(const header& h);
+
+  void append(uint16_t id, unsigned char type, const string_ref& str);
+  void append_file(uint16_t id, int fd, off_t offset, size_t size);
+  bool send_file();
+  bool parse_input();
+  static ssize_t sendfile_nosignal(int out, int in, off_t* offset, size_t n);
+  bool flush_ring();
+  void end_request(uint16_t id, unsigned int app_status, unsigned char proto_status);
+  bool params_done(request* r);
+  void report_stats(request* r);
+  void measure(request* r, unsigned char proto_status);
+  void admitted(request* r);
+  void end_input(request* r);
+  void dispatch(request* r);
+  void reject(request* r, const char* status = "400 Bad Request");
+  void shed(request* r);
+  void cancel(request* r);
+  void abort(request* r);
+  void release(request* r);
+  bool flush();
+  static bool parse_size(const string_ref& s, size_t& n);
+
+  bool congested() const;
+  void pause(request* r);
+  void drain();
+
+private:
+  server& server_;
+  int fd_;
+  parser parser_;
+  char* in_;
+  size_t in_size_;
+  chain_message out_;
+  file* files_;
+  file* last_file_;
+  request_table reqs_;
+  size_t paused_;
+  bool closing_;
+
+  // io_uring backend: sendmsg in flight owns msg_ and iov_, connection
+  // is deleted when the last operation in flight completes
+  msghdr msg_;
+  struct iovec iov_[max_iov];
+  unsigned pending_;
+  bool sending_;
+  bool polling_;
+  bool dead_;
+
+  bool dirty_;
+  connection* next_dirty_;
+  connection* prev_;
+  connection* next_;
+};
+
+
+/*
+ * Single producer / single consumer ring of accepted descriptors,
+ * used to pass connections from an acceptor thread to a worker
+ */
+class handoff_queue {
+public:
+  handoff_queue();
+
+  bool push(int fd);
+  bool pop(int& fd);
+
+  enum {
+    capacity = 1024
+  };
+
+private:
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  int fds_[capacity];
+};
+
+
+class stats;
+
+/*
+ * Counters and distributions of one server. Only the thread running the
+ * server writes them, with relaxed load and store of atomics, which costs
+ * what a plain increment does; any thread may read them meanwhile.
+ * Distributions are log-linear histograms, 4 buckets per power of two.
+ */
+class alignas(64) metrics {
+public:
+  enum counter {
+    requests,                       // begun
+    completed,                      // ended with FCGI_REQUEST_COMPLETE
+    rejected,                       // FCGI_OVERLOADED
+    refused,                        // other protocol status, or bad request
+    aborted,                        // FCGI_ABORT_REQUEST or connection lost
+    records_in,
+    bytes_in,
+    bytes_out,
+    connections_accepted,
+    connections_active,             // gauges
+    requests_active,
+    counter_count
+  };
+
+  enum distribution {
+    records_per_request,
+    parse_time,                     // ns, per batch of received bytes
+    handler_time,                   // ns, from on_params() to END_REQUEST
+    queue_time,                     // ns in admission queue
+    request_time,                   // ns, from BEGIN_REQUEST to END_REQUEST
+    distribution_count
+  };
+
+  enum {
+    sub_bits = 2,
+    buckets = (64 - sub_bits + 1) << sub_bits
+  };
+
+  metrics();
+
+  void add(counter c, uint64_t n = 1);
+  void set(counter c, uint64_t v);
+  void record(distribution d, uint64_t v);
+
+  void collect(stats& s) const;
+
+  static size_t bucket(uint64_t v);
+  static uint64_t highest(size_t b);
+
+private:
+  metrics(const metrics&);
+  metrics& operator=(const metrics&);
+
+private:
+  std::atomic<uint64_t> counters_[counter_count];
+  std::atomic<uint64_t> sums_[distribution_count];
+  std::atomic<uint64_t> buckets_[distribution_count][buckets];
+};
+
+
+/*
+ * Snapshot of metrics, summed over servers when collected from several
+ */
+class stats {
+public:
+  stats();
+
+  uint64_t get(metrics::counter c) const;
+  uint64_t count(metrics::distribution d) const;
+  uint64_t sum(metrics::distribution d) const;
+  uint64_t percentile(metrics::distribution d, double p) const;
+
+  std::string format() const;
+
+  static const char* name(metrics::counter c);
+  static const char* name(metrics::distribution d);
+
+private:
+  friend class metrics;
+
+  uint64_t counters_[metrics::counter_count];
+  uint64_t sums_[metrics::distribution_count];
+  uint64_t buckets_[metrics::distribution_count][metrics::buckets];
+};
+
+
+class server {
+public:
+  server(handler& h);
+  ~server();
+
+  int listen(int fd);
+  int listen_unix(const char* path, int backlog);
+  int listen_tcp(const char* host, unsigned short port, int backlog,
+    bool reuse_port = false);
+
+  int adopt(int fd);
+  int use_uring();
+  void watermarks(size_t high, size_t low);
+  void limits(size_t max_conns, size_t max_reqs);
+  void params_limit(size_t bytes);
+  void admission(size_t concurrency, size_t queue, unsigned int target_ms = codel_target,
+    unsigned int interval_ms = codel_interval);
+
+  int run();
+  void stop();
+
+  size_t connections() const;
+  size_t requests() const;
+  size_t running() const;
+  size_t queued() const;
+  size_t shed() const;
+  size_t max_conns() const;
+  size_t max_reqs() const;
+
+  void stats_path(const std::string& path);
+  void collect(stats& s) const;
+
+  const buffer_pool& pool() const;
+  const buffer_pool& recv_pool() const;
+
+  static int bind_unix(const char* path, int backlog);
+  static int bind_tcp(const char* host, unsigned short port, int backlog,
+    bool reuse_port);
+
+  enum {
+    high_watermark = 256 * 1024,
+    low_watermark = 64 * 1024,
+    params_max = 64 * 1024,
+    max_events = 256,
+    ring_entries = 1024,
+    ring_buffers = 128,
+    ring_buffer_size = 16 * 1024,
+    codel_target = 5,       // ms
+    codel_interval = 100    // ms
+  };
+
+private:
+  friend class connection;
+  friend class workers;
+
+  // io_uring completions are told apart by the low bits of user_data
+  enum {
+    tag_accept = 1,
+    tag_wake,
+    tag_recv,
+    tag_send,
+    tag_poll,
+    tag_mask = 7
+  };
+
+  int watch(int fd);
+  void accept_conns(int fd);
+  void adopt_conns();
+  void add_conn(int fd);
+  void close_conn(connection* c);
+  void dirty(connection* c);
+  void flush_dirty();
+
+  enum admit_result {
+    admit_now,
+    admit_queued,
+    admit_shed
+  };
+  admit_result admit(request* r);
+  void run_queue();
+  bool codel(uint64_t sojourn, uint64_t now);
+  void unqueue(request* r);
+  static uint64_t now_ns();
+
+  // time in handler code while in scope, parse time is measured without it
+  class handler_clock {
+  public:
+    handler_clock(server& s) : s_(s), start_(now_ns()) { }
+    ~handler_clock() { s_.in_handler_ += now_ns() - start_; }
+  private:
+    server& s_;
+    uint64_t start_;
+  };
+
+  int run_ring();
+  void on_completion(const io_uring_cqe& e);
+  io_uring_sqe* submission(uint64_t data);
+  void arm_accept(int fd);
+  void arm_wake();
+  void arm_recv(connection* c);
+
+  request* alloc_request();
+  void free_request(request* r);
+
+  static int nonblock(int fd);
+
+private:
+  handler& handler_;
+  int epoll_;
+  int wake_;
+  bool use_ring_;
+  uring* ring_;
+  std::atomic<bool> running_;
+  std::vector<int> listeners_;
+  handoff_queue queue_;
+  buffer_pool pool_;
+  buffer_pool recv_pool_;
+  request* free_reqs_;
+  connection* conns_;
+  size_t conns_count_;
+  connection* dirty_;
+  size_t high_water_;
+  size_t low_water_;
+  size_t max_conns_;                // 0 is no limit
+  size_t max_reqs_;
+  size_t params_limit_;             // PARAMS content bytes per request
+  size_t reqs_count_;
+  size_t shards_;                   // servers of workers sharing the limits
+
+  // admission control, off while concurrency_ is 0
+  size_t concurrency_;
+  size_t queue_limit_;
+  size_t running_count_;
+  size_t queued_count_;
+  size_t shed_count_;
+  request* queue_head_;
+  request* queue_tail_;
+  uint64_t target_;                 // ns
+  uint64_t interval_;
+  uint64_t first_above_;
+  uint64_t drop_next_;
+  size_t drops_;
+  bool dropping_;
+
+  metrics metrics_;
+  uint64_t in_handler_;             // ns, during current parse
+  std::string stats_path_;          // SCRIPT_NAME answered with stats
+  const std::vector<server*>* siblings_; // servers of workers, stats cover them all
+};
+
+
+/*
+ * N servers, each running its own loop in its own thread. TCP listeners
+ * are sharded with SO_REUSEPORT, other listeners are served by an acceptor
+ * (thread calling run()) that hands connections out round-robin.
+ * Handler is shared and has to be thread safe.
+ */
+class workers {
+public:
+  workers(handler& h, size_t threads);
+  ~workers();
+
+  int listen(int fd);
+  int listen_unix(const char* path, int backlog);
+  int listen_tcp(const char* host, unsigned short port, int backlog);
+  int use_uring();
+  void watermarks(size_t high, size_t low);
+  void limits(size_t max_conns, size_t max_reqs);
+  void params_limit(size_t bytes);
+  void admission(size_t concurrency, size_t queue, unsigned int target_ms = server::codel_target,
+    unsigned int interval_ms = server::codel_interval);
+  void stats_path(const std::string& path);
+  void collect(stats& s) const;
+
+  int run();
+  void stop();
+
+  size_t size() const;
+  server& worker(size_t i);
+
+private:
+  void accept_conns(int fd);
+
+private:
+  std::vector<server*> servers_;
+  std::vector<int> listeners_;
+  int wake_;
+  std::atomic<bool> running_;
+  size_t next_;
+};
+
+
+inline
+request::request(buffer_pool& pool) :
+  conn_(0), id_(0), role_(0), flags_(0),
+  active_(false), ended_(false), aborted_(false), dispatched_(false),
+  stdout_(false), stderr_(false), paused_(false), params_done_(false),
+  streaming_(false), input_done_(false), input_taken_(false), input_wait_(false),
+  admitted_(false), queued_(false),
+  waiter_(0), resume_(0), content_length_(no_length), received_(0), params_size_(0),
+  arena_(pool), reader_(arena_), params_(0), last_param_(0), next_free_(0),
+  queued_at_(0), prev_queued_(0), next_queued_(0), begun_at_(0), started_at_(0), records_(0),
+  outcome_(0) {
+}
+
+inline
+uint16_t request::id() const {
+  return id_;
+}
+
+inline
+unsigned int request::role() const {
+  return role_;
+}
+
+inline
+unsigned char request::flags() const {
+  return flags_;
+}
+
+inline
+bool request::keep_conn() const {
+  return flags_ & FCGI_KEEP_CONN;
+}
+
+/*
+ * Decoded pairs in the order they came, names and values live in arena
+ */
+inline
+const request::pair* request::params() const {
+  return params_;
+}
+
+/*
+ * Lookups go through params_index, oversized param sets fall back
+ * to linear scan.
+ */
+inline
+string_ref request::param(params_index::known k) const {
+  if (index_.good()) return index_.get(k);
+  return param(params_index::name(k));
+}
+
+inline
+string_ref request::param(const string_ref& name) const {
+  string_ref v;
+  if (index_.good()) {
+    index_.find(name, v);
+    return v;
+  }
+  // later value of repeated name wins, as in the index
+  for(const pair* p = params_; p; p = p->next) {
+    if (p->name == name) v = p->value;
+  }
+  return v;
+}
+
+/*
+ * Request body gathered so far, see stream_input()
+ */
+inline
+string_ref request::input() const {
+  return input_.str();
+}
+
+/*
+ * Called from handler::on_params() to take STDIN as it arrives instead of
+ * all of it in input(): chunks go to handler::on_input() straight from the
+ * receive buffer and are valid during the call only. Coroutine waiting in
+ * read_stdin() gets them there; chunks coming while it waits for something
+ * else are gathered in input() until it asks.
+ */
+inline
+void request::stream_input() {
+  streaming_ = true;
+}
+
+/*
+ * CONTENT_LENGTH or no_length. Body longer or shorter than that fails the
+ * request: handler sees it aborted, web server gets 400 if no output was
+ * written yet.
+ */
+inline
+size_t request::content_length() const {
+  return content_length_;
+}
+
+/*
+ * STDIN bytes received so far
+ */
+inline
+size_t request::input_size() const {
+  return received_;
+}
+
+inline
+request& request::append(unsigned char type, const string_ref& str) {
+  if (active_ && !ended_ && str.size()) {
+    if (type == FCGI_STDOUT) stdout_ = true;
+    if (type == FCGI_STDERR) stderr_ = true;
+    conn_->append(id_, type, str);
+    if (!paused_ && conn_->congested()) conn_->pause(this);
+  }
+  return *this;
+}
+
+inline
+request& request::write(const string_ref& str) {
+  return append(FCGI_STDOUT, str);
+}
+
+/*
+ * Sends size bytes of file from offset as FCGI_STDOUT straight from the
+ * page cache with sendfile(), content never enters user space. fd is
+ * owned by the engine from now on and closed once sent; file must not
+ * shrink meanwhile.
+ */
+inline
+request& request::write_file(int fd, off_t offset, size_t size) {
+  if (active_ && !ended_ && size) {
+    stdout_ = true;
+    conn_->append_file(id_, fd, offset, size);
+  } else {
+    close(fd);
+  }
+  return *this;
+}
+
+inline
+void request::end_request(unsigned int app_status, unsigned char proto_status) {
+  if (!active_ || ended_) return;
+
+  if (stderr_) conn_->append(id_, FCGI_STDERR, string_ref());
+  conn_->append(id_, FCGI_STDOUT, string_ref());
+  conn_->end_request(id_, app_status, proto_status);
+  conn_->measure(this, proto_status);
+  ended_ = true;
+}
+
+/*
+ * co_await r.read_stdin() gives next piece of request body, empty string
+ * when it is over. Whole body comes at once unless stream_input() is on,
+ * then a piece is valid until the next co_await.
+ */
+inline
+request::stdin_awaiter request::read_stdin() {
+  stdin_awaiter a = { *this };
+  return a;
+}
+
+/*
+ * co_await r.write_stdout(str) writes str and suspends while the
+ * connection is over high watermark; false when request is aborted
+ */
+inline
+request::stdout_awaiter request::write_stdout(const string_ref& str) {
+  write(str);
+  stdout_awaiter a = { *this };
+  return a;
+}
+
+inline
+bool request::active() const {
+  return active_;
+}
+
+inline
+bool request::ended() const {
+  return ended_;
+}
+
+/*
+ * Connection went away or web server sent FCGI_ABORT_REQUEST before the
+ * request was ended, writes are dropped. Long running handlers poll it;
+ * handler::on_abort() is called and suspended coroutine is resumed when
+ * it turns true.
+ */
+inline
+bool request::aborted() const {
+  return aborted_;
+}
+
+/*
+ * False when output queued on the connection is over the high watermark:
+ * producer should stop writing and return, handler::on_drain() is called
+ * for the request once the queue falls under the low watermark. Writes
+ * are still accepted meanwhile, it is up to the producer to hold them.
+ */
+inline
+bool request::writable() {
+  if (!active_ || ended_) return false;
+  if (paused_) return false;
+  if (!conn_->congested()) return true;
+  conn_->pause(this);
+  return false;
+}
+
+/*
+ * Scratch memory living until the request is over
+ */
+inline
+tinyfcgi::arena& request::arena() {
+  return arena_;
+}
+
+inline
+void request::begin(connection* c, uint16_t id, const begin_request_body& b) {
+  clear();
+  conn_ = c;
+  id_ = id;
+  role_ = b.role();
+  flags_ = b.flags;
+  active_ = true;
+}
+
+inline
+void request::clear() {
+  active_ = false;
+  ended_ = false;
+  aborted_ = false;
+  dispatched_ = false;
+  stdout_ = false;
+  stderr_ = false;
+  paused_ = false;
+  params_done_ = false;
+  streaming_ = false;
+  input_done_ = false;
+  input_taken_ = false;
+  input_wait_ = false;
+  admitted_ = false;
+  queued_ = false;
+  begun_at_ = started_at_ = 0;
+  records_ = 0;
+  outcome_ = metrics::completed;
+  waiter_ = 0;
+  content_length_ = no_length;
+  received_ = 0;
+  chunk_ = string_ref();
+  record_ = string_ref();
+  params_size_ = 0;
+  reader_.reset();
+  params_ = last_param_ = 0;
+  index_.clear();
+  input_.clear();
+  arena_.clear();
+}
+
+/*
+ * Called by params_reader for every decoded pair. Pair inside the record
+ * is in receive buffer, which is reused: its name and value are copied
+ * behind the pair. Pair cut by record boundary is in arena already.
+ */
+inline
+bool request::on_param(const string_ref& name, const string_ref& value) {
+  bool in_record = name.data() >= record_.data()
+    && name.data() < record_.data() + record_.size();
+  size_t n = sizeof(pair) + (in_record ? name.size() + value.size() : 0);
+  pair* p = (pair*)arena_.alloc(n);
+  if (!p) return false;
+  if (in_record) {
+    char* d = (char*)(p + 1);
+    memcpy(d, name.data(), name.size());
+    memcpy(d + name.size(), value.data(), value.size());
+    p->name = string_ref(d, name.size());
+    p->value = string_ref(d + name.size(), value.size());
+  } else {
+    p->name = name;
+    p->value = value;
+  }
+  p->next = 0;
+  if (last_param_) last_param_->next = p;
+  else params_ = p;
+  last_param_ = p;
+
+  index_.add(name, value);
+  return true;
+}
+
+inline
+string_ref request::take_input() {
+  string_ref s;
+  if (chunk_.data()) {
+    // handed over from receive buffer
+    s = chunk_;
+    chunk_ = string_ref();
+    return s;
+  }
+  if (!streaming_) {
+    if (input_taken_) return s;
+    input_taken_ = true;
+    return input_.str();
+  }
+  s = input_.str();
+  input_.rewind();
+  return s;
+}
+
+inline
+void request::wait(void* coroutine, void (*resume)(void*), bool input) {
+  waiter_ = coroutine;
+  resume_ = resume;
+  input_wait_ = input;
+}
+
+/*
+ * Resumes suspended coroutine, false when there is none
+ */
+inline
+bool request::wake() {
+  if (!waiter_) return false;
+  void* w = waiter_;
+  waiter_ = 0;
+  input_wait_ = false;
+  resume_(w);
+  return true;
+}
+
+
+inline
+request_table::request_table() :
+  size_(0) {
+  memset(ids_, 0, sizeof(ids_));
+}
+
+inline
+request* request_table::find(uint16_t id) const {
+  size_t i = id % capacity;
+  for(size_t n = 0; n < capacity && ids_[i]; ++n, i = (i + 1) % capacity) {
+    if (ids_[i] == id) return reqs_[i];
+  }
+  return 0;
+}
+
+inline
+bool request_table::insert(uint16_t id, request* r) {
+  if (size_ == capacity) return false;
+
+  size_t i = id % capacity;
+  while(ids_[i]) i = (i + 1) % capacity;
+
+  ids_[i] = id;
+  reqs_[i] = r;
+  ++size_;
+  return true;
+}
+
+/*
+ * Backward shift deletion, no tombstones to skip on lookups
+ */
+inline
+request* request_table::erase(uint16_t id) {
+  size_t i = id % capacity;
+  for(size_t n = 0; ids_[i] != id; ++n, i = (i + 1) % capacity) {
+    if (!ids_[i] || n == capacity) return 0;
+  }
+  request* r = reqs_[i];
+  ids_[i] = 0;
+  --size_;
+
+  for(size_t j = (i + 1) % capacity; ids_[j]; j = (j + 1) % capacity) {
+    size_t home = ids_[j] % capacity;
+    // entry at j may move to i if its home is not in (i, j]
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (stays) continue;
+
+    ids_[i] = ids_[j];
+    reqs_[i] = reqs_[j];
+    ids_[j] = 0;
+    i = j;
+  }
+  return r;
+}
+
+inline
+size_t request_table::size() const {
+  return size_;
+}
+
+inline
+request* request_table::at(size_t slot) const {
+  return ids_[slot] ? reqs_[slot] : 0;
+}
+
+
+inline
+connection::connection(server& s, int fd) :
+  server_(s), fd_(fd), in_(0), in_size_(0),
+  out_(FCGI_NULL_REQUEST_ID, s.pool_), files_(0), last_file_(0),
+  paused_(0), closing_(false), pending_(0), sending_(false), polling_(false), dead_(false),
+  dirty_(false), next_dirty_(0), prev_(0), next_(0) {
+  memset(&msg_, 0, sizeof(msg_));
+  msg_.msg_iov = iov_;
+}
+
+inline
+connection::~connection() {
+  // erase shifts entries back, so keep going round until table is empty
+  for(size_t i = 0; reqs_.size(); i = (i + 1) % request_table::capacity) {
+    request* r = reqs_.at(i);
+    if (!r) continue;
+    reqs_.erase(r->id());
+    if (!r->ended_) {
+      // lost with connection, no END_REQUEST counts it
+      server_.metrics_.add(metrics::aborted);
+      abort(r);
+    }
+    server_.free_request(r);
+  }
+  while(files_) {
+    file* f = files_;
+    files_ = f->next;
+    close(f->fd);
+    delete f;
+  }
+  if (in_) server_.recv_pool_.free(in_);
+  close(fd_);
+}
+
+inline
+int connection::fd() const {
+  return fd_;
+}
+
+inline
+bool connection::on_readable() {
+  // receive buffer is held only while there is unparsed input
+  if (!in_ && !(in_ = server_.recv_pool_.alloc())) return false;
+
+  while(!closing_) {
+    ssize_t r = read(fd_, in_ + in_size_, recv_buffer_size - in_size_);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return false;
+    }
+    if (r == 0) {
+      // peer is done with sending, deliver what is already built
+      closing_ = true;
+      break;
+    }
+    in_size_ += r;
+    server_.metrics_.add(metrics::bytes_in, r);
+
+    if (!parse_input()) return false;
+  }
+
+  if (!in_size_) {
+    server_.recv_pool_.free(in_);
+    in_ = 0;
+  }
+  server_.dirty(this);
+  return true;
+}
+
+/*
+ * Bytes received by io_uring into its own buffer. Complete records are
+ * parsed in place, only a cut record is copied to receive buffer.
+ */
+inline
+bool connection::on_data(const char* data, size_t size) {
+  server_.metrics_.add(metrics::bytes_in, size);
+
+  while(size && !closing_) {
+    if (!in_size_) {
+      uint64_t start = server::now_ns();
+      server_.in_handler_ = 0;
+      bool ok = parser_.parse(data, size, *this);
+      server_.metrics_.record(metrics::parse_time, server::now_ns() - start - server_.in_handler_);
+      if (!ok) return false;
+      size_t done = parser_.parsed();
+      parser_.consume(done);
+      data += done;
+      size -= done;
+      if (!size) break;
+
+      // less than a record is left, it always fits
+      if (!in_ && !(in_ = server_.recv_pool_.alloc())) return false;
+      memcpy(in_, data, size);
+      in_size_ = size;
+      break;
+    }
+
+    size_t n = recv_buffer_size - in_size_;
+    if (n > size) n = size;
+    memcpy(in_ + in_size_, data, n);
+    in_size_ += n;
+    data += n;
+    size -= n;
+    if (!parse_input()) return false;
+  }
+
+  if (in_ && !in_size_) {
+    server_.recv_pool_.free(in_);
+    in_ = 0;
+  }
+  server_.dirty(this);
+  return true;
+}
+
+inline
+bool connection::on_writable() {
+  server_.dirty(this);
+  return true;
+}
+
+inline
+bool connection::on_header(const header& /* h */) {
+  server_.metrics_.add(metrics::records_in);
+  return true;
+}
+
+inline
+bool connection::on_content(const header& h, const string_ref& s) {
+  if (h.type != FCGI_STDIN || s.empty()) return true;
+
+  request* r = reqs_.find(h.id());
+  if (!r || r->ended() || r->input_done_) return true;
+  if (!r->params_done_ && !params_done(r)) return true;
+
+  r->received_ += s.size();
+  if (r->received_ > r->content_length_) {
+    reject(r);
+    return true;
+  }
+
+  if (!r->streaming_ || (r->waiter_ && !r->input_wait_)) {
+    // whole body, or chunks coming while coroutine waits for output
+    if (!r->input_.append(r->arena_, s)) {
+      r->outcome_ = metrics::rejected;
+      r->end_request(0, FCGI_OVERLOADED);
+      abort(r);
+      release(r);
+    }
+    return true;
+  }
+
+  {
+    server::handler_clock t(server_);
+    if (r->input_wait_) {
+      r->chunk_ = s;
+      r->wake();
+    } else {
+      server_.handler_.on_input(*r, s);
+    }
+  }
+  if (r->ended()) release(r);
+  return true;
+}
+
+inline
+bool connection::on_record(const header& h) {
+  uint16_t id = h.id();
+  if (id == FCGI_NULL_REQUEST_ID) return on_management(h);
+
+  if (h.type == FCGI_BEGIN_REQUEST) {
+    if (h.size() < sizeof(FCGI_BeginRequestBody)) return false;
+    // repeated BEGIN_REQUEST for active id is ignored
+    if (reqs_.find(id)) return true;
+
+    server_.metrics_.add(metrics::requests);
+    request* r = server_.alloc_request();
+    if (!r || !reqs_.insert(id, r)) {
+      if (r) server_.free_request(r);
+      end_request(id, 0, FCGI_OVERLOADED);
+      server_.metrics_.add(metrics::rejected);
+      return true;
+    }
+    r->begin(this, id, *h.begin_request());
+    r->begun_at_ = server::now_ns();
+    r->records_ = 1;
+    if (r->role() != FCGI_RESPONDER) {
+      r->outcome_ = metrics::refused;
+      r->end_request(0, FCGI_UNKNOWN_ROLE);
+      release(r);
+    }
+    return true;
+  }
+
+  // records of unknown requests are ignored
+  request* r = reqs_.find(id);
+  if (!r || r->ended()) return true;
+  ++r->records_;
+
+  switch(h.type) {
+  case FCGI_PARAMS:
+    // decoded in receive buffer, only pairs go to arena
+    if (h.size()) {
+      r->params_size_ += h.size();
+      if (r->params_size_ > server_.params_limit_) {
+        reject(r, "431 Request Header Fields Too Large");
+        break;
+      }
+      r->record_ = h.str();
+      bool fed = r->reader_.feed(h.str(), *r);
+      r->record_ = string_ref();
+      if (!fed) {
+        r->outcome_ = metrics::rejected;
+        r->end_request(0, FCGI_OVERLOADED);
+        release(r);
+      }
+    } else if (!r->params_done_) {
+      params_done(r);
+    }
+    break;
+  case FCGI_STDIN:
+    if (h.size() == 0) end_input(r);
+    break;
+  case FCGI_ABORT_REQUEST:
+    cancel(r);
+    break;
+  }
+  return true;
+}
+
+/*
+ * FCGI_GET_VALUES is answered with limits in force now, other management
+ * records with FCGI_UNKNOWN_TYPE
+ */
+inline
+bool connection::on_management(const header& h) {
+  if (h.type != FCGI_GET_VALUES) {
+    out_.unknown_type(h.type);
+    server_.dirty(this);
+    return true;
+  }
+
+  values v;
+  v.parse(h.str());
+  if (v.has(values::max_conns)) v.set(values::max_conns, server_.max_conns());
+  if (v.has(values::max_reqs)) v.set(values::max_reqs, server_.max_reqs());
+  // requests of a connection are independent, any number may be in flight
+  if (v.has(values::mpxs_conns)) v.set(values::mpxs_conns, 1);
+  out_.get_values_result(v);
+  server_.dirty(this);
+  return true;
+}
+
+/*
+ * Empty str terminates the stream
+ */
+inline
+void connection::append(uint16_t id, unsigned char type, const string_ref& str) {
+  if (str.empty()) out_.id(id).end_stream(type);
+  else out_.id(id).append(type, str);
+  server_.dirty(this);
+}
+
+/*
+ * Builds headers of all records now, content is filled in by flush()
+ */
+inline
+void connection::append_file(uint16_t id, int fd, off_t offset, size_t size) {
+  file* f = new file;
+  f->fd = fd;
+  f->offset = offset;
+  f->left = size;
+  f->at = out_.id(id).seal().consumed() + out_.size() + sizeof(FCGI_Header);
+  f->gap = size < file_record ? size : file_record;
+  f->next = 0;
+  if (last_file_) last_file_->next = f;
+  else files_ = f;
+  last_file_ = f;
+
+  while(size) {
+    size_t n = size < file_record ? size : file_record;
+    out_.external(FCGI_STDOUT, n);
+    size -= n;
+  }
+  server_.dirty(this);
+}
+
+inline
+void connection::end_request(uint16_t id, unsigned int app_status, unsigned char proto_status) {
+  out_.id(id).end_request(app_status, proto_status);
+  server_.dirty(this);
+}
+
+/*
+ * Params are complete, at empty PARAMS record or first STDIN record.
+ * False when request is gone.
+ */
+inline
+bool connection::params_done(request* r) {
+  r->params_done_ = true;
+  string_ref v = r->param(params_index::CONTENT_LENGTH);
+  if (!v.empty() && !parse_size(v, r->content_length_)) {
+    reject(r);
+    return false;
+  }
+  if (!server_.stats_path_.empty() &&
+    r->param(params_index::SCRIPT_NAME) == string_ref(server_.stats_path_)) {
+    report_stats(r);
+    return false;
+  }
+
+  switch(server_.admit(r)) {
+  case server::admit_now:
+    break;
+  case server::admit_queued:
+    // STDIN is gathered in input() meanwhile
+    return true;
+  case server::admit_shed:
+    shed(r);
+    return false;
+  }
+
+  r->started_at_ = server::now_ns();
+  {
+    server::handler_clock t(server_);
+    server_.handler_.on_params(*r);
+  }
+  if (r->streaming_) r->dispatched_ = true;
+  if (r->ended()) {
+    release(r);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Request for the stats path is answered by the engine: metrics of the
+ * server, of all workers when it is one of them, in Prometheus text format
+ */
+inline
+void connection::report_stats(request* r) {
+  stats s;
+  server_.collect(s);
+  r->write("Content-Type: text/plain; version=0.0.4\r\n\r\n")
+    .write(s.format());
+  r->end_request(0);
+  release(r);
+}
+
+/*
+ * Request is counted once, in what the engine ended it for, or by status
+ * handler ended it with
+ */
+inline
+void connection::measure(request* r, unsigned char proto_status) {
+  metrics& m = server_.metrics_;
+  uint64_t now = server::now_ns();
+  int c = r->outcome_;
+  if (c == metrics::completed && proto_status != FCGI_REQUEST_COMPLETE) {
+    c = proto_status == FCGI_OVERLOADED ? metrics::rejected : metrics::refused;
+  }
+  m.add((metrics::counter)c);
+  m.record(metrics::request_time, now - r->begun_at_);
+  if (r->started_at_) m.record(metrics::handler_time, now - r->started_at_);
+}
+
+/*
+ * Request left admission queue, handler sees it now with whatever came
+ * meanwhile: body gathered so far goes to on_input() as one chunk when
+ * streamed (coroutine takes it with read_stdin()), complete request is
+ * dispatched right away
+ */
+inline
+void connection::admitted(request* r) {
+  r->started_at_ = server::now_ns();
+  {
+    server::handler_clock t(server_);
+    server_.handler_.on_params(*r);
+    if (r->streaming_) {
+      r->dispatched_ = true;
+      if (!r->ended() && !r->waiter_ && r->input_.size()) {
+        server_.handler_.on_input(*r, r->input_.str());
+        r->input_.rewind();
+      }
+    }
+  }
+  if (r->ended()) {
+    release(r);
+    return;
+  }
+  if (!r->input_done_) return;
+
+  if (r->input_wait_) {
+    server::handler_clock t(server_);
+    r->wake();
+  }
+  if (r->ended()) release(r);
+  else dispatch(r);
+}
+
+/*
+ * Empty STDIN record
+ */
+inline
+void connection::end_input(request* r) {
+  if (r->input_done_) return;
+  if (!r->params_done_ && !params_done(r)) return;
+
+  r->input_done_ = true;
+  if (r->content_length_ != request::no_length && r->received_ != r->content_length_) {
+    reject(r);
+    return;
+  }
+  if (r->queued_) return;
+  if (r->input_wait_) {
+    server::handler_clock t(server_);
+    r->wake();
+  }
+  if (r->ended()) release(r);
+  else dispatch(r);
+}
+
+inline
+void connection::dispatch(request* r) {
+  r->dispatched_ = true;
+  {
+    server::handler_clock t(server_);
+    server_.handler_.on_request(*r);
+  }
+  if (r->ended()) release(r);
+}
+
+/*
+ * Body does not match CONTENT_LENGTH, or params are over the limit
+ */
+inline
+void connection::reject(request* r, const char* status) {
+  if (!r->stdout_) r->write("Status: ").write(status).write("\r\n\r\n");
+  r->outcome_ = metrics::refused;
+  r->end_request(1);
+  abort(r);
+  release(r);
+}
+
+/*
+ * Turned away by admission control before handler saw it
+ */
+inline
+void connection::shed(request* r) {
+  r->outcome_ = metrics::rejected;
+  r->end_request(0, FCGI_OVERLOADED);
+  release(r);
+}
+
+/*
+ * FCGI_ABORT_REQUEST, nobody is going to read the response. Its output
+ * not written yet is taken back unless files or an io_uring send hold
+ * the queue in place (flow control bounds what is left then), and
+ * END_REQUEST goes out at once.
+ */
+inline
+void connection::cancel(request* r) {
+  if (!files_ && !sending_) out_.drop(r->id());
+  r->outcome_ = metrics::aborted;
+  r->end_request(0);
+  abort(r);
+  release(r);
+}
+
+/*
+ * Request is dropped under the handler: it sees it ended and aborted,
+ * nothing it writes reaches the connection. Handler hears of it once it
+ * has seen the request, from on_params() on.
+ */
+inline
+void connection::abort(request* r) {
+  r->ended_ = r->aborted_ = true;
+  if (!r->started_at_) return;
+
+  server::handler_clock t(server_);
+  if (!r->wake()) server_.handler_.on_abort(*r);
+}
+
+inline
+void connection::release(request* r) {
+  if (!r->keep_conn()) closing_ = true;
+  if (r->paused_) --paused_;
+  server_.free_request(reqs_.erase(r->id()));
+}
+
+/*
+ * Flow control: requests share the socket and its output queue, so the
+ * watermarks apply to bytes queued on the connection (content of files
+ * sent with sendfile() takes no memory and is not counted). Each request
+ * that ran into the high watermark is resumed on its own.
+ */
+inline
+bool connection::congested() const {
+  return out_.size() >= server_.high_water_;
+}
+
+inline
+void connection::pause(request* r) {
+  r->paused_ = true;
+  ++paused_;
+}
+
+/*
+ * Resumes paused requests once enough output is sent, called after
+ * flush(); they are collected first as release() reorders the table
+ */
+inline
+void connection::drain() {
+  if (!paused_ || out_.size() > server_.low_water_) return;
+
+  request* ready[request_table::capacity];
+  size_t n = 0;
+  for(size_t i = 0; i < request_table::capacity; ++i) {
+    request* r = reqs_.at(i);
+    if (r && r->paused_) {
+      r->paused_ = false;
+      ready[n++] = r;
+    }
+  }
+  paused_ = 0;
+
+  for(size_t i = 0; i < n; ++i) {
+    {
+      server::handler_clock t(server_);
+      // coroutine waiting for input is not waiting for this
+      if (ready[i]->input_wait_ || !ready[i]->wake()) server_.handler_.on_drain(*ready[i]);
+    }
+    if (ready[i]->ended()) release(ready[i]);
+  }
+}
+
+/*
+ * Parses receive buffer, drops complete records from it. Time spent is
+ * measured without handler code called meanwhile.
+ */
+inline
+bool connection::parse_input() {
+  uint64_t start = server::now_ns();
+  server_.in_handler_ = 0;
+  bool ok = parser_.parse(in_, in_size_, *this);
+  server_.metrics_.record(metrics::parse_time, server::now_ns() - start - server_.in_handler_);
+  if (!ok) return false;
+
+  size_t done = parser_.parsed();
+  memmove(in_, in_ + done, in_size_ - done);
+  in_size_ -= done;
+  parser_.consume(done);
+  return true;
+}
+
+inline
+bool connection::parse_size(const string_ref& s, size_t& n) {
+  n = 0;
+  for(size_t i = 0; i < s.size(); ++i) {
+    unsigned d = (unsigned char)s[i] - '0';
+    if (d > 9 || n > (request::no_length - 1 - d) / 10) return false;
+    n = n * 10 + d;
+  }
+  return true;
+}
+
+inline
+bool connection::flush() {
+  if (!out_) return false;
+
+  out_.seal();
+  if (server_.ring_) return flush_ring();
+
+  while(out_.size() || files_) {
+    // chain goes out up to the gap of the first pending file
+    size_t limit = files_ ? files_->at - out_.consumed() : out_.size();
+    if (limit == 0) {
+      if (!send_file()) return false;
+      if (files_ && files_->at == out_.consumed()) return true;
+      continue;
+    }
+
+    struct iovec v[max_iov];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = v;
+    msg.msg_iovlen = out_.iov(v, max_iov);
+    // bytes counted but not in buffers: nothing would ever go out
+    if (msg.msg_iovlen == 0) return false;
+    for(size_t i = 0; i < msg.msg_iovlen; ++i) {
+      if (v[i].iov_len >= limit) {
+        v[i].iov_len = limit;
+        msg.msg_iovlen = i + 1;
+        break;
+      }
+      limit -= v[i].iov_len;
+    }
+
+    ssize_t r = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      return false;
+    }
+    out_.consume(r);
+    server_.metrics_.add(metrics::bytes_out, r);
+  }
+  return !closing_;
+}
+
+/*
+ * Same as flush() for io_uring backend: one sendmsg of the chain is in
+ * flight at a time and goes to kernel with the next batch of submissions,
+ * its completion calls flush() again.
+ */
+inline
+bool connection::flush_ring() {
+  if (sending_ || polling_) return true;
+
+  while(out_.size() || files_) {
+    size_t limit = files_ ? files_->at - out_.consumed() : out_.size();
+    if (limit == 0) {
+      if (!send_file()) return false;
+      if (files_ && files_->at == out_.consumed()) {
+        // socket is full, go on when it is writable
+        io_uring_sqe* s = server_.submission((uint64_t)(uintptr_t)this | server::tag_poll);
+        if (!s) return false;
+        s->opcode = IORING_OP_POLL_ADD;
+        s->fd = fd_;
+        s->poll32_events = POLLOUT;
+        polling_ = true;
+        ++pending_;
+        return true;
+      }
+      continue;
+    }
+
+    size_t n = out_.iov(iov_, max_iov);
+    if (n == 0) return false;
+    for(size_t i = 0; i < n; ++i) {
+      if (iov_[i].iov_len >= limit) {
+        iov_[i].iov_len = limit;
+        n = i + 1;
+        break;
+      }
+      limit -= iov_[i].iov_len;
+    }
+    msg_.msg_iovlen = n;
+
+    io_uring_sqe* s = server_.submission((uint64_t)(uintptr_t)this | server::tag_send);
+    if (!s) return false;
+    s->opcode = IORING_OP_SENDMSG;
+    s->fd = fd_;
+    s->addr = (uint64_t)(uintptr_t)&msg_;
+    s->len = 1;
+    s->msg_flags = MSG_NOSIGNAL;
+    sending_ = true;
+    ++pending_;
+    return true;
+  }
+  return !closing_;
+}
+
+/*
+ * Fills the gap at the front of out_ from first pending file. True when
+ * progress is made or socket is full (then the gap is still there), false
+ * on errors including a file shorter than promised: framing is lost then.
+ */
+inline
+bool connection::send_file() {
+  file* f = files_;
+  while(f->gap) {
+    ssize_t r = sendfile_nosignal(fd_, f->fd, &f->offset, f->gap);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      return false;
+    }
+    if (r == 0) return false;
+    server_.metrics_.add(metrics::bytes_out, r);
+    f->gap -= r;
+    f->left -= r;
+  }
+
+  if (f->left) {
+    // next gap is right after header of next record
+    f->at += sizeof(FCGI_Header);
+    f->gap = f->left < file_record ? f->left : file_record;
+    return true;
+  }
+
+  files_ = f->next;
+  if (!files_) last_file_ = 0;
+  close(f->fd);
+  delete f;
+  return true;
+}
+
+/*
+ * sendfile() has no MSG_NOSIGNAL: SIGPIPE of a gone peer is blocked in
+ * this thread for the call and dropped
+ */
+inline
+ssize_t connection::sendfile_nosignal(int out, int in, off_t* offset, size_t n) {
+  sigset_t pipe, old;
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe, &old);
+
+  ssize_t r = sendfile(out, in, offset, n);
+  int e = errno;
+  if (r == -1 && e == EPIPE) {
+    timespec zero = {0, 0};
+    sigtimedwait(&pipe, 0, &zero);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  errno = e;
+  return r;
+}
+
+
+inline
+handoff_queue::handoff_queue() :
+  head_(0), tail_(0) {
+}
+
+inline
+bool handoff_queue::push(int fd) {
+  size_t t = tail_.load(std::memory_order_relaxed);
+  if (t - head_.load(std::memory_order_acquire) == capacity) return false;
+
+  fds_[t % capacity] = fd;
+  tail_.store(t + 1, std::memory_order_release);
+  return true;
+}
+
+inline
+bool handoff_queue::pop(int& fd) {
+  size_t h = head_.load(std::memory_order_relaxed);
+  if (h == tail_.load(std::memory_order_acquire)) return false;
+
+  fd = fds_[h % capacity];
+  head_.store(h + 1, std::memory_order_release);
+  return true;
+}
+
+
+inline
+metrics::metrics() {
+  for(size_t i = 0; i < counter_count; ++i) counters_[i].store(0, std::memory_order_relaxed);
+  for(size_t d = 0; d < distribution_count; ++d) {
+    sums_[d].store(0, std::memory_order_relaxed);
+    for(size_t b = 0; b < buckets; ++b) buckets_[d][b].store(0, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * Single writer, so no read-modify-write is needed
+ */
+inline
+void metrics::add(counter c, uint64_t n) {
+  counters_[c].store(counters_[c].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline
+void metrics::set(counter c, uint64_t v) {
+  counters_[c].store(v, std::memory_order_relaxed);
+}
+
+inline
+void metrics::record(distribution d, uint64_t v) {
+  std::atomic<uint64_t>& b = buckets_[d][bucket(v)];
+  b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  sums_[d].store(sums_[d].load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+/*
+ * Adds to what s holds, so servers can be summed up
+ */
+inline
+void metrics::collect(stats& s) const {
+  for(size_t i = 0; i < counter_count; ++i) {
+    s.counters_[i] += counters_[i].load(std::memory_order_relaxed);
+  }
+  for(size_t d = 0; d < distribution_count; ++d) {
+    s.sums_[d] += sums_[d].load(std::memory_order_relaxed);
+    for(size_t b = 0; b < buckets; ++b) {
+      s.buckets_[d][b] += buckets_[d][b].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Values under 2 << sub_bits have buckets of their own
+ */
+inline
+size_t metrics::bucket(uint64_t v) {
+  if (v < (2u << sub_bits)) return (size_t)v;
+  int e = 63 - __builtin_clzll(v) - sub_bits;
+  return ((size_t)e << sub_bits) + (size_t)(v >> e);
+}
+
+inline
+uint64_t metrics::highest(size_t b) {
+  if (b < (2u << sub_bits)) return b;
+  int e = (int)(b >> sub_bits) - 1;
+  uint64_t m = b - ((size_t)e << sub_bits);
+  return ((m + 1) << e) - 1;
+}
+
+
+inline
+stats::stats() {
+  memset(counters_, 0, sizeof(counters_));
+  memset(sums_, 0, sizeof(sums_));
+  memset(buckets_, 0, sizeof(buckets_));
+}
+
+inline
+uint64_t stats::get(metrics::counter c) const {
+  return counters_[c];
+}
+
+inline
+uint64_t stats::count(metrics::distribution d) const {
+  uint64_t n = 0;
+  for(size_t b = 0; b < metrics::buckets; ++b) n += buckets_[d][b];
+  return n;
+}
+
+inline
+uint64_t stats::sum(metrics::distribution d) const {
+  return sums_[d];
+}
+
+/*
+ * Upper bound of the bucket p (0..1) of values fall into, within 25%
+ */
+inline
+uint64_t stats::percentile(metrics::distribution d, double p) const {
+  uint64_t n = count(d);
+  if (!n) return 0;
+  uint64_t rank = (uint64_t)ceil(p * n);
+  if (rank < 1) rank = 1;
+
+  uint64_t seen = 0;
+  for(size_t b = 0; b < metrics::buckets; ++b) {
+    seen += buckets_[d][b];
+    if (seen >= rank) return metrics::highest(b);
+  }
+  return 0;
+}
+
+/*
+ * Prometheus text exposition: counters, gauges and summaries; times go
+ * in seconds
+ */
+inline
+std::string stats::format() const {
+  std::string out;
+  char line[256];
+
+  for(size_t i = 0; i < metrics::counter_count; ++i) {
+    metrics::counter c = (metrics::counter)i;
+    bool gauge = c >= metrics::connections_active;
+    snprintf(line, sizeof(line), "# TYPE tinyfcgi_%s%s %s\ntinyfcgi_%s%s %llu\n",
+      name(c), gauge ? "" : "_total", gauge ? "gauge" : "counter",
+      name(c), gauge ? "" : "_total", (unsigned long long)counters_[c]);
+    out += line;
+  }
+
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  for(size_t i = 0; i < metrics::distribution_count; ++i) {
+    metrics::distribution d = (metrics::distribution)i;
+    double scale = d == metrics::records_per_request ? 1 : 1e-9;
+
+    snprintf(line, sizeof(line), "# TYPE tinyfcgi_%s summary\n", name(d));
+    out += line;
+    for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+      snprintf(line, sizeof(line), "tinyfcgi_%s{quantile=\"%g\"} %g\n",
+        name(d), quantiles[q], percentile(d, quantiles[q]) * scale);
+      out += line;
+    }
+    snprintf(line, sizeof(line), "tinyfcgi_%s_sum %g\ntinyfcgi_%s_count %llu\n",
+      name(d), sums_[d] * scale, name(d), (unsigned long long)count(d));
+    out += line;
+  }
+  return out;
+}
+
+inline
+const char* stats::name(metrics::counter c) {
+  static const char* names[metrics::counter_count] = {
+    "requests", "completed", "rejected", "refused", "aborted", "records_in", "bytes_in", "bytes_out",
+    "connections_accepted", "connections_active", "requests_active"
+  };
+  return names[c];
+}
+
+inline
+const char* stats::name(metrics::distribution d) {
+  static const char* names[metrics::distribution_count] = {
+    "records_per_request", "parse_seconds", "handler_seconds", "queue_seconds", "request_seconds"
+  };
+  return names[d];
+}
+
+
+inline
+server::server(handler& h) :
+  handler_(h), epoll_(epoll_create1(EPOLL_CLOEXEC)),
+  wake_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), use_ring_(false), ring_(0),
+  running_(true),
+  recv_pool_(connection::recv_buffer_size, 64), free_reqs_(0),
+  conns_(0), conns_count_(0), dirty_(0),
+  high_water_(high_watermark), low_water_(low_watermark),
+  max_conns_(0), max_reqs_(0), params_limit_(params_max), reqs_count_(0), shards_(1),
+  concurrency_(0), queue_limit_(0), running_count_(0), queued_count_(0), shed_count_(0),
+  queue_head_(0), queue_tail_(0), target_(codel_target * 1000000ull), interval_(codel_interval * 1000000ull),
+  first_above_(0), drop_next_(0), drops_(0), dropping_(false),
+  in_handler_(0), siblings_(0) {
+  if (epoll_ != -1 && wake_ != -1) watch(wake_);
+}
+
+inline
+server::~server() {
+  int fd;
+  while(queue_.pop(fd)) close(fd);
+  while(conns_) close_conn(conns_);
+  for(size_t i = 0; i < listeners_.size(); ++i) {
+    close(listeners_[i]);
+  }
+  if (wake_ != -1) close(wake_);
+  if (epoll_ != -1) close(epoll_);
+  while(free_reqs_) {
+    request* r = free_reqs_;
+    free_reqs_ = r->next_free_;
+    delete r;
+  }
+}
+
+inline
+int server::listen(int fd) {
+  if (nonblock(fd) == -1 || watch(fd) == -1) return -1;
+
+  listeners_.push_back(fd);
+  return 0;
+}
+
+inline
+int server::listen_unix(const char* path, int backlog) {
+  int fd = bind_unix(path, backlog);
+  if (fd == -1) return -1;
+
+  if (listen(fd) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+inline
+int server::listen_tcp(const char* host, unsigned short port, int backlog,
+  bool reuse_port) {
+  int fd = bind_tcp(host, port, backlog, reuse_port);
+  if (fd == -1) return -1;
+
+  if (listen(fd) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Takes ownership of connected socket fd. Safe to call from one thread
+ * other than the one running the loop.
+ */
+inline
+int server::adopt(int fd) {
+  if (!queue_.push(fd)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  uint64_t one = 1;
+  ssize_t r = write(wake_, &one, sizeof(one));
+  (void)r;
+  return 0;
+}
+
+/*
+ * Switches to io_uring backend: multishot accept, multishot receive into
+ * provided buffers and sends batched with the wait for completions, so a
+ * loop iteration costs one system call. -1 when kernel lacks support,
+ * epoll backend is kept then. Handlers see no difference.
+ */
+inline
+int server::use_uring() {
+  if (!uring::supported()) return -1;
+  use_ring_ = true;
+  return 0;
+}
+
+/*
+ * Output queued per connection above which request::writable() turns
+ * false, and below which paused requests get handler::on_drain()
+ */
+inline
+void server::watermarks(size_t high, size_t low) {
+  high_water_ = high;
+  low_water_ = low < high ? low : high;
+}
+
+/*
+ * Connections over max_conns are closed right after accept, requests
+ * over max_reqs are ended with FCGI_OVERLOADED; 0 is no limit. Web
+ * servers asking with FCGI_GET_VALUES are told these.
+ */
+inline
+void server::limits(size_t max_conns, size_t max_reqs) {
+  max_conns_ = max_conns;
+  max_reqs_ = max_reqs;
+}
+
+/*
+ * Request sending more PARAMS content than bytes is answered with 431
+ * before its handler sees it
+ */
+inline
+void server::params_limit(size_t bytes) {
+  params_limit_ = bytes;
+}
+
+/*
+ * Up to concurrency requests are in the handler at once, counted from
+ * complete params until released. Others wait in a queue of up to queue
+ * requests, more are ended with FCGI_OVERLOADED at once. Queue is kept
+ * short by CoDel: once requests leaving it have waited over target_ms
+ * for a whole interval_ms, they are shed instead of run, more often the
+ * longer that lasts. Concurrency 0 turns it off.
+ */
+inline
+void server::admission(size_t concurrency, size_t queue, unsigned int target_ms,
+  unsigned int interval_ms) {
+  concurrency_ = concurrency;
+  queue_limit_ = queue;
+  target_ = target_ms * 1000000ull;
+  interval_ = interval_ms * 1000000ull;
+}
+
+inline
+int server::run() {
+  if (use_ring_) {
+    // ring belongs to the thread running the loop
+    uring ring;
+    if (ring.init(ring_entries, ring_buffers, ring_buffer_size) == 0) {
+      ring_ = &ring;
+      int r = run_ring();
+      ring_ = 0;
+      return r;
+    }
+  }
+
+  epoll_event events[max_events];
+
+  while(running_.load(std::memory_order_relaxed)) {
+    int n = epoll_wait(epoll_, events, max_events, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    for(int i = 0; i < n; ++i) {
+      const epoll_event& ev = events[i];
+      if (ev.data.u64 & 1) {
+        int fd = (int)(ev.data.u64 >> 1);
+        if (fd == wake_) adopt_conns();
+        else accept_conns(fd);
+        continue;
+      }
+
+      connection* c = (connection*)ev.data.ptr;
+      bool ok = !(ev.events & EPOLLERR);
+      if (ok && (ev.events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))) ok = c->on_readable();
+      if (ok && (ev.events & EPOLLOUT)) ok = c->on_writable();
+      if (!ok) close_conn(c);
+    }
+    flush_dirty();
+  }
+  return 0;
+}
+
+inline
+int server::run_ring() {
+  for(size_t i = 0; i < listeners_.size(); ++i) arm_accept(listeners_[i]);
+  arm_wake();
+  for(connection* c = conns_; c; c = c->next_) arm_recv(c);
+
+  while(running_.load(std::memory_order_relaxed)) {
+    if (ring_->enter(1) == -1 && errno != EINTR && errno != EBUSY) return -1;
+
+    while(io_uring_cqe* e = ring_->cqe()) {
+      io_uring_cqe c = *e;
+      ring_->seen();
+      on_completion(c);
+    }
+    // sends go to kernel with the next wait
+    flush_dirty();
+  }
+  return 0;
+}
+
+inline
+void server::on_completion(const io_uring_cqe& e) {
+  uint64_t tag = e.user_data & tag_mask;
+  bool more = e.flags & IORING_CQE_F_MORE;
+
+  if (tag == tag_accept) {
+    int fd = (int)(e.user_data >> 3);
+    if (e.res >= 0) add_conn(e.res);
+    if (!more && running_) arm_accept(fd);
+    return;
+  }
+  if (tag == tag_wake) {
+    adopt_conns();
+    arm_wake();
+    return;
+  }
+
+  connection* c = (connection*)(uintptr_t)(e.user_data & ~(uint64_t)tag_mask);
+  bool ok = true;
+  if (tag == tag_recv) {
+    if (!more) --c->pending_;
+    if (e.flags & IORING_CQE_F_BUFFER) {
+      unsigned bid = e.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (e.res > 0 && !c->dead_) ok = c->on_data(ring_->buffer(bid), e.res);
+      ring_->recycle(bid);
+    }
+    if (c->dead_) {
+    } else if (e.res == 0) {
+      // peer is done with sending, deliver what is already built
+      c->closing_ = true;
+      dirty(c);
+    } else if (e.res < 0 && e.res != -ENOBUFS) {
+      ok = false;
+    } else if (ok && !more && !c->closing_) {
+      arm_recv(c);
+    }
+  } else if (tag == tag_send) {
+    --c->pending_;
+    c->sending_ = false;
+    if (e.res < 0) ok = false;
+    else if (!c->dead_) {
+      c->out_.consume(e.res);
+      metrics_.add(metrics::bytes_out, e.res);
+      dirty(c);
+    }
+  } else if (tag == tag_poll) {
+    --c->pending_;
+    c->polling_ = false;
+    if (!c->dead_) dirty(c);
+  }
+  if (!ok || c->dead_) close_conn(c);
+}
+
+/*
+ * Submission entry tagged with data, pushes prepared ones to kernel when
+ * ring is full
+ */
+inline
+io_uring_sqe* server::submission(uint64_t data) {
+  io_uring_sqe* s = ring_->sqe();
+  if (!s && ring_->enter(0) != -1) s = ring_->sqe();
+  if (s) s->user_data = data;
+  return s;
+}
+
+inline
+void server::arm_accept(int fd) {
+  io_uring_sqe* s = submission(((uint64_t)fd << 3) | tag_accept);
+  if (!s) return;
+  s->opcode = IORING_OP_ACCEPT;
+  s->fd = fd;
+  s->ioprio = IORING_ACCEPT_MULTISHOT;
+  s->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/*
+ * eventfd is non-blocking, so wait for it with poll and read it in
+ * adopt_conns() as epoll backend does
+ */
+inline
+void server::arm_wake() {
+  io_uring_sqe* s = submission(tag_wake);
+  if (!s) return;
+  s->opcode = IORING_OP_POLL_ADD;
+  s->fd = wake_;
+  s->poll32_events = POLLIN;
+}
+
+inline
+void server::arm_recv(connection* c) {
+  io_uring_sqe* s = submission((uint64_t)(uintptr_t)c | tag_recv);
+  if (!s) return;
+  s->opcode = IORING_OP_RECV;
+  s->fd = c->fd_;
+  s->ioprio = IORING_RECV_MULTISHOT;
+  s->flags = IOSQE_BUFFER_SELECT;
+  s->buf_group = uring::buffer_group;
+  ++c->pending_;
+}
+
+inline
+void server::stop() {
+  running_ = false;
+
+  uint64_t one = 1;
+  ssize_t r = write(wake_, &one, sizeof(one));
+  (void)r;
+}
+
+/*
+ * Requests begun and not released yet
+ */
+inline
+size_t server::requests() const {
+  return reqs_count_;
+}
+
+/*
+ * Requests in the handler, as counted by admission control
+ */
+inline
+size_t server::running() const {
+  return running_count_;
+}
+
+inline
+size_t server::queued() const {
+  return queued_count_;
+}
+
+/*
+ * Requests ended with FCGI_OVERLOADED by admission control so far
+ */
+inline
+size_t server::shed() const {
+  return shed_count_;
+}
+
+/*
+ * FCGI_MAX_CONNS as told to web servers: limit of all workers together,
+ * or as many descriptors as the process may open when there is none
+ */
+inline
+size_t server::max_conns() const {
+  if (max_conns_) return max_conns_ * shards_;
+
+  rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) return rl.rlim_cur;
+  return 1024 * 1024;
+}
+
+/*
+ * FCGI_MAX_REQS, without a limit every connection may fill its table
+ */
+inline
+size_t server::max_reqs() const {
+  if (max_reqs_) return max_reqs_ * shards_;
+  if (concurrency_) return (concurrency_ + queue_limit_) * shards_;
+  return max_conns() * request_table::capacity;
+}
+
+inline
+size_t server::connections() const {
+  return conns_count_;
+}
+
+/*
+ * Pool of output buffers and request arenas, see its counters
+ */
+inline
+const buffer_pool& server::pool() const {
+  return pool_;
+}
+
+inline
+const buffer_pool& server::recv_pool() const {
+  return recv_pool_;
+}
+
+/*
+ * Requests with this SCRIPT_NAME get stats instead of going to handler,
+ * empty path turns it off
+ */
+inline
+void server::stats_path(const std::string& path) {
+  stats_path_ = path;
+}
+
+/*
+ * Adds metrics of this server to s, or of all workers when it is one;
+ * safe from any thread
+ */
+inline
+void server::collect(stats& s) const {
+  if (!siblings_) return metrics_.collect(s);
+  for(size_t i = 0; i < siblings_->size(); ++i) (*siblings_)[i]->metrics_.collect(s);
+}
+
+inline
+int server::bind_unix(const char* path, int backlog) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1 ||
+      ::listen(fd, backlog) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return fd;
+}
+
+inline
+int server::bind_tcp(const char* host, unsigned short port, int backlog,
+  bool reuse_port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", (unsigned int)port);
+
+  addrinfo* ai = 0;
+  if (getaddrinfo(host, service, &hints, &ai) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd != -1) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((reuse_port &&
+         setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) ||
+        bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+        ::listen(fd, backlog) == -1) {
+      int e = errno;
+      close(fd);
+      errno = e;
+      fd = -1;
+    }
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+/*
+ * Listening sockets and wake up eventfd are tagged with the lowest bit
+ * in epoll data, connections are stored as (aligned) pointers.
+ */
+inline
+int server::watch(int fd) {
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u64 = ((uint64_t)fd << 1) | 1;
+  return epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+inline
+void server::accept_conns(int fd) {
+  while(true) {
+    int s = accept4(fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (s == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      // EAGAIN or we are out of descriptors, retry on next edge
+      return;
+    }
+    add_conn(s);
+  }
+}
+
+inline
+void server::adopt_conns() {
+  uint64_t n;
+  ssize_t r = read(wake_, &n, sizeof(n));
+  (void)r;
+
+  int fd;
+  while(queue_.pop(fd)) {
+    if (nonblock(fd) == -1) {
+      close(fd);
+      continue;
+    }
+    add_conn(fd);
+  }
+}
+
+inline
+void server::add_conn(int fd) {
+  if (max_conns_ && conns_count_ >= max_conns_) {
+    close(fd);
+    return;
+  }
+
+  // FastCGI is request/response, do not let Nagle delay the replies
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  connection* c = new connection(*this, fd);
+
+  if (ring_) {
+    arm_recv(c);
+  } else {
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      delete c;
+      return;
+    }
+  }
+
+  c->next_ = conns_;
+  if (conns_) conns_->prev_ = c;
+  conns_ = c;
+  ++conns_count_;
+  metrics_.add(metrics::connections_accepted);
+  metrics_.set(metrics::connections_active, conns_count_);
+}
+
+inline
+void server::close_conn(connection* c) {
+  if (ring_ && c->pending_) {
+    // operations in flight complete with errors, the last one gets here
+    if (!c->dead_) shutdown(c->fd_, SHUT_RDWR);
+    c->dead_ = true;
+    return;
+  }
+
+  if (c->dirty_) {
+    connection** p = &dirty_;
+    while(*p != c) p = &(*p)->next_dirty_;
+    *p = c->next_dirty_;
+  }
+
+  if (c->prev_) c->prev_->next_ = c->next_;
+  else conns_ = c->next_;
+  if (c->next_) c->next_->prev_ = c->prev_;
+  --conns_count_;
+  metrics_.set(metrics::connections_active, conns_count_);
+
+  delete c;
+}
+
+/*
+ * Connection has output to send or has to be closed. Output of all
+ * requests answered during a loop iteration goes out in one write at
+ * its end, including writes made outside of handler::on_request().
+ */
+inline
+void server::dirty(connection* c) {
+  if (c->dirty_) return;
+  c->dirty_ = true;
+  c->next_dirty_ = dirty_;
+  dirty_ = c;
+}
+
+inline
+void server::flush_dirty() {
+  // admitted requests write output flushed here, slots freed by drain()
+  // take more from the queue
+  do {
+    run_queue();
+    while(dirty_) {
+      connection* c = dirty_;
+      dirty_ = c->next_dirty_;
+      c->dirty_ = false;
+      if (c->dead_) continue;
+      if (!c->flush()) close_conn(c);
+      else c->drain();
+    }
+  } while(queue_head_ && running_count_ < concurrency_);
+}
+
+/*
+ * Request with complete params asks to get to the handler
+ */
+inline
+server::admit_result server::admit(request* r) {
+  if (!concurrency_) return admit_now;
+  if (running_count_ < concurrency_ && !queue_head_) {
+    r->admitted_ = true;
+    ++running_count_;
+    metrics_.record(metrics::queue_time, 0);
+    return admit_now;
+  }
+  if (queued_count_ >= queue_limit_) {
+    ++shed_count_;
+    return admit_shed;
+  }
+
+  r->queued_ = true;
+  r->queued_at_ = now_ns();
+  r->prev_queued_ = queue_tail_;
+  r->next_queued_ = 0;
+  if (queue_tail_) queue_tail_->next_queued_ = r;
+  else queue_head_ = r;
+  queue_tail_ = r;
+  ++queued_count_;
+  return admit_queued;
+}
+
+/*
+ * Moves queued requests to free slots, oldest first, or sheds them
+ */
+inline
+void server::run_queue() {
+  if (!queue_head_ || running_count_ >= concurrency_) return;
+
+  uint64_t now = now_ns();
+  while(queue_head_ && running_count_ < concurrency_) {
+    request* r = queue_head_;
+    unqueue(r);
+    // io_uring connection waiting for its last completion to be deleted
+    if (r->conn_->dead_) continue;
+    metrics_.record(metrics::queue_time, now - r->queued_at_);
+    if (codel(now - r->queued_at_, now)) {
+      ++shed_count_;
+      r->conn_->shed(r);
+      continue;
+    }
+    r->admitted_ = true;
+    ++running_count_;
+    r->conn_->admitted(r);
+  }
+}
+
+/*
+ * CoDel (RFC 8289) on time spent in queue. Queue keeping requests over
+ * target for a whole interval is standing rather than absorbing a burst;
+ * then one is shed, and next ones after interval / sqrt(drops), until a
+ * request comes through under target.
+ */
+inline
+bool server::codel(uint64_t sojourn, uint64_t now) {
+  if (sojourn < target_) {
+    first_above_ = 0;
+    dropping_ = false;
+    return false;
+  }
+  if (!first_above_) {
+    first_above_ = now + interval_;
+    return false;
+  }
+  if (now < first_above_) return false;
+
+  if (!dropping_) {
+    dropping_ = true;
+    // recent dropping state resumes near its rate
+    drops_ = drops_ > 2 && now - drop_next_ < 8 * interval_ ? drops_ - 2 : 1;
+    drop_next_ = now + (uint64_t)(interval_ / sqrt((double)drops_));
+    return true;
+  }
+  if (now < drop_next_) return false;
+  ++drops_;
+  drop_next_ += (uint64_t)(interval_ / sqrt((double)drops_));
+  return true;
+}
+
+inline
+void server::unqueue(request* r) {
+  if (r->prev_queued_) r->prev_queued_->next_queued_ = r->next_queued_;
+  else queue_head_ = r->next_queued_;
+  if (r->next_queued_) r->next_queued_->prev_queued_ = r->prev_queued_;
+  else queue_tail_ = r->prev_queued_;
+  r->prev_queued_ = r->next_queued_ = 0;
+  r->queued_ = false;
+  --queued_count_;
+}
+
+inline
+uint64_t server::now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Request objects are recycled, their arenas give memory back to pool_
+ */
+inline
+request* server::alloc_request() {
+  if (max_reqs_ && reqs_count_ >= max_reqs_) return 0;
+  ++reqs_count_;
+  metrics_.set(metrics::requests_active, reqs_count_);
+  if (!free_reqs_) return new request(pool_);
+
+  request* r = free_reqs_;
+  free_reqs_ = r->next_free_;
+  return r;
+}
+
+inline
+void server::free_request(request* r) {
+  --reqs_count_;
+  metrics_.set(metrics::requests_active, reqs_count_);
+  if (r->records_) metrics_.record(metrics::records_per_request, r->records_);
+  if (r->admitted_) --running_count_;
+  if (r->queued_) unqueue(r);
+  r->clear();
+  r->next_free_ = free_reqs_;
+  free_reqs_ = r;
+}
+
+inline
+int server::nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+inline
+workers::workers(handler& h, size_t threads) :
+  wake_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), running_(true), next_(0) {
+  if (threads == 0) threads = 1;
+  for(size_t i = 0; i < threads; ++i) {
+    servers_.push_back(new server(h));
+    servers_.back()->shards_ = threads;
+    servers_.back()->siblings_ = &servers_;
+  }
+}
+
+inline
+workers::~workers() {
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    delete servers_[i];
+  }
+  for(size_t i = 0; i < listeners_.size(); ++i) {
+    close(listeners_[i]);
+  }
+  if (wake_ != -1) close(wake_);
+}
+
+inline
+int workers::listen(int fd) {
+  if (server::nonblock(fd) == -1) return -1;
+
+  listeners_.push_back(fd);
+  return 0;
+}
+
+inline
+int workers::listen_unix(const char* path, int backlog) {
+  int fd = server::bind_unix(path, backlog);
+  if (fd == -1) return -1;
+
+  if (listen(fd) == -1) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * io_uring backend for all workers, see server::use_uring()
+ */
+inline
+int workers::use_uring() {
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    if (servers_[i]->use_uring() == -1) return -1;
+  }
+  return 0;
+}
+
+inline
+void workers::watermarks(size_t high, size_t low) {
+  for(size_t i = 0; i < servers_.size(); ++i) servers_[i]->watermarks(high, low);
+}
+
+/*
+ * Limits of every worker, web servers are told their sum
+ */
+inline
+void workers::limits(size_t max_conns, size_t max_reqs) {
+  for(size_t i = 0; i < servers_.size(); ++i) servers_[i]->limits(max_conns, max_reqs);
+}
+
+inline
+void workers::params_limit(size_t bytes) {
+  for(size_t i = 0; i < servers_.size(); ++i) servers_[i]->params_limit(bytes);
+}
+
+/*
+ * Admission control of every worker, concurrency and queue are per worker
+ */
+inline
+void workers::admission(size_t concurrency, size_t queue, unsigned int target_ms,
+  unsigned int interval_ms) {
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    servers_[i]->admission(concurrency, queue, target_ms, interval_ms);
+  }
+}
+
+inline
+void workers::stats_path(const std::string& path) {
+  for(size_t i = 0; i < servers_.size(); ++i) servers_[i]->stats_path(path);
+}
+
+/*
+ * Metrics of all workers summed up, safe from any thread
+ */
+inline
+void workers::collect(stats& s) const {
+  if (!servers_.empty()) servers_[0]->collect(s);
+}
+
+/*
+ * Every worker gets its own listening socket on the same address,
+ * kernel spreads incoming connections between them.
+ */
+inline
+int workers::listen_tcp(const char* host, unsigned short port, int backlog) {
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    if (servers_[i]->listen_tcp(host, port, backlog, true) == -1) return -1;
+  }
+  return 0;
+}
+
+inline
+int workers::run() {
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    threads.push_back(std::thread(&server::run, servers_[i]));
+  }
+
+  std::vector<pollfd> fds(listeners_.size() + 1);
+  for(size_t i = 0; i < listeners_.size(); ++i) {
+    fds[i].fd = listeners_[i];
+    fds[i].events = POLLIN;
+  }
+  fds[listeners_.size()].fd = wake_;
+  fds[listeners_.size()].events = POLLIN;
+
+  int res = 0;
+  while(running_.load(std::memory_order_relaxed)) {
+    if (listeners_.empty()) {
+      // nothing to accept here, just wait for stop()
+      uint64_t n;
+      pollfd& w = fds.back();
+      if (poll(&w, 1, -1) > 0) {
+        ssize_t r = read(wake_, &n, sizeof(n));
+        (void)r;
+      }
+      continue;
+    }
+
+    int n = poll(&fds[0], fds.size(), -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      res = -1;
+      break;
+    }
+    for(size_t i = 0; i < listeners_.size(); ++i) {
+      if (fds[i].revents & POLLIN) accept_conns(fds[i].fd);
+    }
+  }
+
+  for(size_t i = 0; i < servers_.size(); ++i) {
+    servers_[i]->stop();
+  }
+  for(size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  return res;
+}
+
+inline
+void workers::stop() {
+  running_ = false;
+
+  uint64_t one = 1;
+  ssize_t r = write(wake_, &one, sizeof(one));
+  (void)r;
+}
+
+inline
+size_t workers::size() const {
+  return servers_.size();
+}
+
+inline
+server& workers::worker(size_t i) {
+  return *servers_[i];
+}
+
+inline
+void workers::accept_conns(int fd) {
+  while(true) {
+    int s = accept4(fd, 0, 0, SOCK_CLOEXEC);
+    if (s == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+
+    // round-robin, skip workers with full queues
+    size_t i = 0;
+    for(; i < servers_.size(); ++i) {
+      server* w = servers_[next_++ % servers_.size()];
+      if (w->adopt(s) == 0) break;
+    }
+    if (i == servers_.size()) close(s);
+  }
+}
+
+}
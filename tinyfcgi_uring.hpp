@@ -0,0 +1,365 @@
+/*
+ * tinyfcgi::uring is a minimal io_uring wrapper on raw system calls, just
+ * what tinyfcgi::server needs for its io_uring backend: submission and
+ * completion rings and one ring of provided receive buffers. Server arms
+ * multishot recv, which needs Linux 6.0 or later, use supported() to find
+ * out.
+
+Synopsys
+
+{
+  tinyfcgi::uring ring;
+  if (ring.init(4096, 256, 16 * 1024) == -1) return;                  // fall back to epoll
+
+  io_uring_sqe* s = ring.sqe();                                       // 0 when submission ring is full
+  s->opcode = IORING_OP_RECV;
+  s->fd = sock;
+  s->flags = IOSQE_BUFFER_SELECT;                                     // kernel picks a buffer ..
+  s->buf_group = tinyfcgi::uring::buffer_group;
+  s->user_data = 1;
+
+  ring.enter(1);                                                      // submit and wait, one syscall
+  while(io_uring_cqe* c = ring.cqe()) {
+    unsigned bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+    use(ring.buffer(bid), c->res);
+    ring.recycle(bid);                                                // .. and gets it back here
+    ring.seen();
+  }
+}
+
+ */
+
+// vim:ts=2:sts=2:sw=2:et
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace tinyfcgi {
+
+class uring {
+public:
+  uring();
+  ~uring();
+
+  int init(unsigned entries, unsigned buffers, size_t buffer_size);
+  void clear();
+  static bool supported();
+
+  io_uring_sqe* sqe();
+  int enter(unsigned wait);
+
+  io_uring_cqe* cqe();
+  void seen();
+
+  char* buffer(unsigned bid) const;
+  void recycle(unsigned bid);
+
+  enum {
+    buffer_group = 0
+  };
+
+private:
+  uring(const uring&);
+  uring& operator=(const uring&);
+
+  int setup(unsigned entries, unsigned flags);
+  int add_buffers(unsigned buffers, size_t buffer_size);
+
+  static unsigned load(const unsigned* p);
+  static void store(unsigned* p, unsigned v);
+
+private:
+  int fd_;
+  unsigned flags_;
+
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned sqe_tail_;
+  unsigned unsubmitted_;
+
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  io_uring_buf_ring* br_;
+  size_t br_size_;
+  unsigned br_mask_;
+  char* bufs_;
+  size_t buffer_size_;
+};
+
+
+inline
+uring::uring() :
+  fd_(-1), flags_(0), sq_ring_(0), sq_ring_size_(0), cq_ring_(0), cq_ring_size_(0),
+  sqes_(0), sqes_size_(0), sq_head_(0), sq_tail_(0), sq_mask_(0), sq_entries_(0),
+  sqe_tail_(0), unsubmitted_(0), cq_head_(0), cq_tail_(0), cq_mask_(0), cqes_(0),
+  br_(0), br_size_(0), br_mask_(0), bufs_(0), buffer_size_(0) {
+}
+
+inline
+uring::~uring() {
+  clear();
+}
+
+/*
+ * Sets up rings of entries submissions and buffers receive buffers of
+ * buffer_size each. -1 with errno when kernel does not support it. Ring is
+ * bound to the calling thread, so call it from the thread using it.
+ */
+inline
+int uring::init(unsigned entries, unsigned buffers, size_t buffer_size) {
+  clear();
+  // deferred task work is cheaper but needs 6.1, try it first
+  if (setup(entries, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) == -1 &&
+      setup(entries, 0) == -1) {
+    return -1;
+  }
+  if (add_buffers(buffers, buffer_size) == -1) {
+    int e = errno;
+    clear();
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+inline
+void uring::clear() {
+  if (fd_ != -1) close(fd_);
+  if (sqes_) munmap(sqes_, sqes_size_);
+  if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+  if (br_) munmap(br_, br_size_);
+  free(bufs_);
+
+  fd_ = -1;
+  sq_ring_ = cq_ring_ = 0;
+  sqes_ = 0;
+  br_ = 0;
+  bufs_ = 0;
+  sqe_tail_ = unsubmitted_ = 0;
+}
+
+/*
+ * Probes for io_uring with provided buffer rings and multishot recv: a
+ * kernel without the latter takes the ring but fails every recv with
+ * -EINVAL, so one is armed on a socketpair and has to stay armed
+ */
+inline
+bool uring::supported() {
+  uring r;
+  if (r.init(8, 1, 4096) == -1) return false;
+
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) return false;
+  bool ok = false;
+  io_uring_sqe* s = r.sqe();
+  s->opcode = IORING_OP_RECV;
+  s->fd = sv[0];
+  s->ioprio = IORING_RECV_MULTISHOT;
+  s->flags = IOSQE_BUFFER_SELECT;
+  s->buf_group = buffer_group;
+  if (write(sv[1], "", 1) == 1 && r.enter(1) != -1) {
+    io_uring_cqe* c = r.cqe();
+    ok = c && c->res == 1 && (c->flags & IORING_CQE_F_MORE);
+  }
+  // closing the ring first cancels the recv still armed
+  r.clear();
+  close(sv[0]);
+  close(sv[1]);
+  return ok;
+}
+
+/*
+ * Next free submission entry, zeroed; 0 when ring is full, enter() then
+ */
+inline
+io_uring_sqe* uring::sqe() {
+  if (sqe_tail_ - load(sq_head_) >= sq_entries_) return 0;
+
+  io_uring_sqe* s = sqes_ + (sqe_tail_ & sq_mask_);
+  memset(s, 0, sizeof(*s));
+  ++sqe_tail_;
+  ++unsubmitted_;
+  return s;
+}
+
+/*
+ * Submits everything prepared and waits for at least wait completions
+ */
+inline
+int uring::enter(unsigned wait) {
+  store(sq_tail_, sqe_tail_);
+
+  unsigned flags = wait || (flags_ & IORING_SETUP_DEFER_TASKRUN) ? IORING_ENTER_GETEVENTS : 0;
+  int r = (int)syscall(__NR_io_uring_enter, fd_, unsubmitted_, wait, flags, 0, 0);
+  if (r == -1) return -1;
+  unsubmitted_ -= r;
+  return r;
+}
+
+/*
+ * Next completion or 0, release it with seen()
+ */
+inline
+io_uring_cqe* uring::cqe() {
+  unsigned head = *cq_head_;
+  if (head == load(cq_tail_)) return 0;
+  return cqes_ + (head & cq_mask_);
+}
+
+inline
+void uring::seen() {
+  store(cq_head_, *cq_head_ + 1);
+}
+
+inline
+char* uring::buffer(unsigned bid) const {
+  return bufs_ + bid * buffer_size_;
+}
+
+/*
+ * Gives receive buffer back to kernel
+ */
+inline
+void uring::recycle(unsigned bid) {
+  // not br_->bufs: in C++ the kernel's flexible array member lands at
+  // offset 8 instead of 0, the empty struct before it takes a byte
+  unsigned short tail = br_->tail;
+  io_uring_buf& b = ((io_uring_buf*)br_)[tail & br_mask_];
+  b.addr = (uint64_t)(uintptr_t)buffer(bid);
+  b.len = (uint32_t)buffer_size_;
+  b.bid = (uint16_t)bid;
+  __atomic_store_n(&br_->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+inline
+int uring::setup(unsigned entries, unsigned flags) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = flags | IORING_SETUP_CQSIZE;
+  // multishot operations post many completions per submission
+  p.cq_entries = entries * 4;
+
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd == -1) return -1;
+
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+    cq_ring_size_ = sq_ring_size_;
+  }
+
+  sq_ring_ = mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = 0;
+    close(fd);
+    return -1;
+  }
+  fd_ = fd;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(0, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = 0;
+      clear();
+      return -1;
+    }
+  }
+
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = (io_uring_sqe*)mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = 0;
+    clear();
+    return -1;
+  }
+
+  char* sq = (char*)sq_ring_;
+  sq_head_ = (unsigned*)(sq + p.sq_off.head);
+  sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  // submission index i always takes sqes_[i]
+  unsigned* array = (unsigned*)(sq + p.sq_off.array);
+  for(unsigned i = 0; i < p.sq_entries; ++i) array[i] = i;
+  sqe_tail_ = *sq_tail_;
+
+  char* cq = (char*)cq_ring_;
+  cq_head_ = (unsigned*)(cq + p.cq_off.head);
+  cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  flags_ = flags;
+  return 0;
+}
+
+/*
+ * Registers ring of provided buffers, count is rounded up to power of 2
+ */
+inline
+int uring::add_buffers(unsigned buffers, size_t buffer_size) {
+  unsigned n = 1;
+  while(n < buffers) n <<= 1;
+
+  br_size_ = n * sizeof(io_uring_buf);
+  void* m = mmap(0, br_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) return -1;
+  br_ = (io_uring_buf_ring*)m;
+  br_->tail = 0;
+  br_mask_ = n - 1;
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)br_;
+  reg.ring_entries = n;
+  reg.bgid = buffer_group;
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) return -1;
+
+  buffer_size_ = buffer_size;
+  bufs_ = (char*)malloc(n * buffer_size);
+  if (!bufs_) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for(unsigned i = 0; i < n; ++i) recycle(i);
+  return 0;
+}
+
+inline
+unsigned uring::load(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline
+void uring::store(unsigned* p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+}